@@ -3,8 +3,103 @@
 #include <functional>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <exception>
+#include <iterator>
+#include <array>
+#include <algorithm>
+#include <stdexcept>
+#include <new>
+
+#if !defined(TINYLINQ_NO_SIMD) && (defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__))
+#define TINYLINQ_SIMD_X86 1
+#if !defined(_MSC_VER) || _MSC_VER >= 1911
+#define TINYLINQ_SIMD_AVX512 1
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define TINYLINQ_TARGET_SSE2
+#define TINYLINQ_TARGET_AVX2
+#define TINYLINQ_TARGET_AVX512
+#else
+#define TINYLINQ_TARGET_SSE2	__attribute__((target("sse2")))
+#define TINYLINQ_TARGET_AVX2	__attribute__((target("avx2")))
+#define TINYLINQ_TARGET_AVX512	__attribute__((target("avx512f")))
+#endif
+
+#if defined(TINYLINQ_SIMD_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#endif
+
 namespace TinyLinq
 {
+	//number of elements a range will still yield, known without enumerating it
+	struct range_size
+	{
+		static const size_t unknown_count = size_t(-1);
+
+		size_t	count;		//exact count, or an upper bound when !is_exact
+		bool	is_exact;
+
+		static range_size exact(size_t n)
+		{
+			range_size ret = {n, true};
+			return ret;
+		}
+
+		static range_size at_most(size_t n)
+		{
+			range_size ret = {n, false};
+			return ret;
+		}
+
+		static range_size unknown()
+		{
+			return at_most(unknown_count);
+		}
+
+		bool is_known() const
+		{
+			return count != unknown_count;
+		}
+
+		friend range_size operator+(const range_size& lhs, const range_size& rhs)
+		{
+			if (!lhs.is_known() || !rhs.is_known() || lhs.count > unknown_count - 1 - rhs.count)
+				return unknown();
+			range_size ret = {lhs.count + rhs.count, lhs.is_exact && rhs.is_exact};
+			return ret;
+		}
+
+		friend range_size operator*(const range_size& lhs, const range_size& rhs)
+		{
+			if (lhs.count == 0 && lhs.is_exact) return lhs;
+			if (rhs.count == 0 && rhs.is_exact) return rhs;
+			if (!lhs.is_known() || !rhs.is_known() || (rhs.count != 0 && lhs.count > (unknown_count - 1) / rhs.count))
+				return unknown();
+			range_size ret = {lhs.count * rhs.count, lhs.is_exact && rhs.is_exact};
+			return ret;
+		}
+
+		range_size clamp(size_t n) const
+		{
+			if (count <= n) return *this;
+			return is_exact ? exact(n) : at_most(n);
+		}
+	};
+
 	template<typename TValue>
 	struct cleanup_type
 	{
@@ -46,588 +141,6519 @@ namespace TinyLinq
 		typedef decltype(dummy_function()(dummy_arg1(),dummy_arg2())) type;
 	};
 	
+	//pointers and std::vector iterators address one contiguous block
 	template<typename TIterator>
-	class basic_range
+	struct is_contiguous_iterator
+	{
+		typedef typename std::iterator_traits<TIterator>::value_type	value_type;
+		static const bool value =
+			std::is_pointer<TIterator>::value ||
+			(!std::is_same<value_type, bool>::value &&
+			(std::is_same<TIterator, typename std::vector<value_type>::iterator>::value ||
+			std::is_same<TIterator, typename std::vector<value_type>::const_iterator>::value));
+	};
+
+	//in place slot for the element a stage computed for its current position, an optional without the heap.
+	//copies start empty: it caches range state rather than being part of it
+	template<typename TValue>
+	class cached_value
 	{
 	public:
-		static TIterator get_iterator();
-		typedef decltype(*get_iterator())						raw_value_type;
-		typedef typename cleanup_type<raw_value_type>::type		value_type;
-		typedef const value_type&								return_type;
-	public:
-		basic_range()
-			:beg(NULL)
-			,end(NULL)
-			,is_first_visit(true)
+		cached_value()
+			:has_value(false)
+		{}
+
+		cached_value(const cached_value&)
+			:has_value(false)
+		{}
+
+		cached_value& operator=(const cached_value&)
 		{
+			reset();
+			return *this;
 		}
-		basic_range(const TIterator& _beg, const TIterator& _end)
-			:beg(_beg)
-			,end(_end)
-			,is_first_visit(true)
-		{}
 
-		bool next() //move forward and return true if the current iter is validate
+		~cached_value()
 		{
-			if (beg == end) return false;
-			if (!is_first_visit)
+			reset();
+		}
+
+		template<typename TArg>
+		TValue& emplace(TArg&& arg)
+		{
+			reset();
+			new (&storage) TValue(std::forward<TArg>(arg));
+			has_value = true;
+			return get();
+		}
+
+		void reset()
+		{
+			if (has_value)
 			{
-				++beg;
+				get().~TValue();
+				has_value = false;
 			}
-			is_first_visit = false;
-			return (beg != end);
 		}
 
-		return_type front()
+		bool engaged() const
 		{
-			return *beg;
+			return has_value;
 		}
 
-	protected:
-		TIterator	beg;
-		TIterator	end;
-		bool		is_first_visit;
-	};
+		TValue& get()
+		{
+			return *reinterpret_cast<TValue*>(&storage);
+		}
 
-	template<class unknow>
-	class DebugClass;
+	private:
+		typename std::aligned_storage<sizeof(TValue), std::alignment_of<TValue>::value>::type	storage;
+		bool																					has_value;
+	};
 
-	template<typename TContainer>
-	class storage_range
+	//in place optional for values that are range state rather than a cache: copies carry them along.
+	//the storage starts zeroed, gcc cannot tell it is only read once has_value is set
+	template<typename TValue>
+	class optional_value
 	{
 	public:
-		typedef typename extract_iterator_type<TContainer>::type iterator_type;
-		typedef typename basic_range<iterator_type>::value_type	value_type;
-		typedef typename basic_range<iterator_type>::return_type	return_type;
+		optional_value()
+			:storage()
+			,has_value(false)
+		{}
 
-	public:
-		storage_range(const TContainer& _container)
-			:container(std::make_shared<TContainer>(_container))
-			,range(basic_range<iterator_type>(container->begin(), container->end()))
+		optional_value(const optional_value& other)
+			:storage()
+			,has_value(false)
 		{
+			if (other.has_value)
+				emplace(other.get());
 		}
 
-		storage_range(TContainer&& _container)
-			:container(std::make_shared<TContainer>(std::move(_container)))
-			,range(basic_range<iterator_type>(container->begin(), container->end()))
+		optional_value(optional_value&& other)
+			:storage()
+			,has_value(false)
 		{
+			if (other.has_value)
+				emplace(std::move(other.get()));
 		}
 
-		bool next()
+		optional_value& operator=(const optional_value& other)
 		{
-			return range.next();
+			if (this != &other)
+			{
+				if (other.has_value)
+					emplace(other.get());
+				else
+					reset();
+			}
+			return *this;
 		}
 
-		return_type front()
+		optional_value& operator=(optional_value&& other)
 		{
-			return range.front();
+			if (this != &other)
+			{
+				if (other.has_value)
+					emplace(std::move(other.get()));
+				else
+					reset();
+			}
+			return *this;
 		}
 
-	private:
-		std::shared_ptr<TContainer>	container;
-		basic_range<iterator_type>	range;
-	};
-
-	template<typename TRange, typename TFunction>
-	class where_range {
-	public:
-		typedef typename TRange::value_type		value_type;
-		typedef typename TRange::return_type	return_type;
+		~optional_value()
+		{
+			reset();
+		}
 
-		where_range(const TRange& _range, TFunction _predicate)
-			:range(_range)
-			,predicate(_predicate) {
+		template<typename TArg>
+		TValue& emplace(TArg&& arg)
+		{
+			reset();
+			new (&storage) TValue(std::forward<TArg>(arg));
+			has_value = true;
+			return get();
 		}
 
-		bool next()
+		void reset()
 		{
-			while (range.next())
+			if (has_value)
 			{
-				if (predicate(range.front()))
-					return true;
+				get().~TValue();
+				has_value = false;
 			}
-			return false;
 		}
 
-		return_type front()
+		bool engaged() const
 		{
-			return range.front();
+			return has_value;
+		}
+
+		TValue& get()
+		{
+			return *reinterpret_cast<TValue*>(&storage);
+		}
+
+		const TValue& get() const
+		{
+			return *reinterpret_cast<const TValue*>(&storage);
 		}
 
 	private:
-		TRange		range;
-		TFunction	predicate;
+		typename std::aligned_storage<sizeof(TValue), std::alignment_of<TValue>::value>::type	storage;
+		bool																					has_value;
 	};
 
-	template<typename TRange, typename TFunction>
-	class select_range
+	//elements moved per next_batch() call by the batched terminals
+	const size_t batch_size = 256;
+
+	//element types that can sit in a batch buffer
+	template<typename TValue>
+	struct is_batchable : std::integral_constant<bool,
+		std::is_default_constructible<TValue>::value &&
+		std::is_copy_assignable<TValue>::value>
 	{
-	public:
-		typedef typename extract_return_type<TFunction,typename TRange::return_type>::type						raw_value_type;
-		typedef typename cleanup_type<raw_value_type>::type												value_type;
-		typedef typename value_type																return_type;
+	};
 
-		select_range(const TRange& _range, TFunction _function)
-			:range(_range)
-			,function(_function)
-		{}
+	template<typename TRange>
+	class has_next_batch
+	{
+		template<typename T>
+		static std::true_type test(decltype(std::declval<T&>().next_batch(
+			std::declval<const typename T::value_type*&>(),
+			static_cast<typename T::value_type*>(NULL),
+			size_t()))*);
 
-		bool next()
+		template<typename T>
+		static std::false_type test(...);
+	public:
+		static const bool value = decltype(test<TRange>(NULL))::value;
+	};
+
+	//element by element fallback: up to n elements copied to buffer, 0 once the range is exhausted
+	template<typename TRange>
+	size_t pull_each(TRange& range, const typename TRange::value_type*& values, typename TRange::value_type* buffer, size_t n)
+	{
+		size_t ret = 0;
+		while (ret < n && range.next())
 		{
-			return range.next();
+			buffer[ret++] = range.front();
 		}
+		values = buffer;
+		return ret;
+	}
 
-		return_type front()
+	template<typename TRange>
+	size_t pull_batch(TRange& range, const typename TRange::value_type*& values, typename TRange::value_type* buffer, size_t n, std::true_type)
+	{
+		return range.next_batch(values, buffer, n);
+	}
+
+	template<typename TRange>
+	size_t pull_batch(TRange& range, const typename TRange::value_type*& values, typename TRange::value_type* buffer, size_t n, std::false_type)
+	{
+		return pull_each(range, values, buffer, n);
+	}
+
+	//points values at up to n of the next elements, through next_batch() when the range has one.
+	//values is either the range's own contiguous storage or buffer (room for n elements) after filling it.
+	//returns 0 only when the range is exhausted; afterwards next() resumes after the last element handed out
+	template<typename TRange>
+	size_t pull_batch(TRange& range, const typename TRange::value_type*& values, typename TRange::value_type* buffer, size_t n)
+	{
+		return pull_batch(range, values, buffer, n, std::integral_constant<bool, has_next_batch<TRange>::value>());
+	}
+
+	template<typename TRange, typename TFunction>
+	void for_each_batch(TRange& source, const TFunction& function, std::true_type)
+	{
+		typedef typename TRange::value_type value_type;
+		std::vector<value_type> buffer(batch_size);
+		const value_type* values = NULL;
+		size_t n;
+		while ((n = pull_batch(source, values, &buffer[0], batch_size)) > 0)
 		{
-			return function(range.front());
+			function(values, n);
 		}
-	private:
-		TRange		range;
-		TFunction	function;
-	};
+	}
 
 	template<typename TRange, typename TFunction>
-	struct select_many_range_helper
+	void for_each_batch(TRange& source, const TFunction& function, std::false_type)
 	{
-		typedef typename extract_return_type<TFunction, typename TRange::return_type>::type						inner_data_type;
-		typedef typename cleanup_type<inner_data_type>::type													clean_inner_data_type;
-		typedef typename extract_iterator_type<inner_data_type>::type											inner_data_iterator_type;
-	
-		typedef typename std::conditional <
-			std::is_lvalue_reference<inner_data_type>::value,
-			basic_range<inner_data_iterator_type>,
-			storage_range < clean_inner_data_type >> ::type inner_range_type;
-	};
+		while (source.next())
+		{
+			const typename TRange::value_type& value = source.front();
+			function(&value, 1);
+		}
+	}
 
+	//hands the rest of source to function(values, n) a batch at a time, or one element
+	//at a time when the elements cannot be buffered
 	template<typename TRange, typename TFunction>
-	class select_many_range
+	void for_each_batch(TRange& source, const TFunction& function)
 	{
-	public:
-
-		typedef	typename select_many_range_helper<TRange, TFunction>::inner_data_type										inner_data_type;
-		typedef	typename select_many_range_helper<TRange, TFunction>::inner_data_iterator_type							inner_data_iterator_type;
-		typedef	typename select_many_range_helper<TRange, TFunction>::inner_range_type							inner_range_type;
+		for_each_batch(source, function, std::integral_constant<bool, is_batchable<typename TRange::value_type>::value>());
+	}
 
-		typedef typename extract_range_trait<inner_range_type>::value_type value_type;
-		typedef typename extract_range_trait<inner_range_type>::return_type return_type;
-		select_many_range(const TRange& _range, TFunction _function)
-			:range(_range)
-			,function(_function)
+	template<typename TIterator>
+	class basic_range
+	{
+	public:
+		static TIterator get_iterator();
+		typedef decltype(*get_iterator())						raw_value_type;
+		typedef typename cleanup_type<raw_value_type>::type		value_type;
+		typedef const value_type&								return_type;
+		typedef typename std::iterator_traits<TIterator>::iterator_category	iterator_category;
+		typedef typename std::is_base_of<
+			std::random_access_iterator_tag,
+			iterator_category>::type							is_random_access;
+		typedef basic_range										slice_type;
+	public:
+		//empty range, value initialized iterators compare equal
+		basic_range()
+			:beg()
+			,end()
+			,is_first_visit(true)
 		{
 		}
+		basic_range(const TIterator& _beg, const TIterator& _end)
+			:beg(_beg)
+			,end(_end)
+			,is_first_visit(true)
+		{}
 
-		bool next()
+		bool next() //move forward and return true if the current iter is validate
 		{
-			if (inner_range && inner_range->next())
-			{
-				return true;
-			}
-
-			if (range.next())
+			if (beg == end) return false;
+			if (!is_first_visit)
 			{
-				inner_range = to_inner_range(function(range.front()), std::is_lvalue_reference<inner_data_type>());
-				return inner_range->next();
+				++beg;
 			}
+			is_first_visit = false;
+			return (beg != end);
+		}
 
-			inner_range.reset();
-			return false;
+		return_type front()
+		{
+			return *beg;
 		}
 
-		std::shared_ptr<inner_range_type> to_inner_range(inner_data_type&& ref,std::true_type)
+		//bidirectional iterators only: step the end back over the last element not visited yet
+		bool next_back()
 		{
-			return make_shared<inner_range_type>(inner_range_type(std::begin(ref), std::end(ref)));
+			if (!is_first_visit && beg != end)
+				++beg;
+			is_first_visit = true;
+			if (beg == end) return false;
+			--end;
+			return true;
 		}
 
-		std::shared_ptr<inner_range_type> to_inner_range(inner_data_type&& ref,std::false_type)
+		//the element the last next_back() stepped over
+		return_type back()
 		{
-			return make_shared<inner_range_type>(std::move(ref));
+			return *end;
 		}
 
-		return_type front()
+		//contiguous iterators hand out their own elements, others are copied to buffer
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
 		{
-			return inner_range->front();
+			if (!is_first_visit && beg != end)
+				++beg;
+			is_first_visit = true;
+			return next_batch(values, buffer, n, std::integral_constant<bool, is_contiguous_iterator<TIterator>::value>());
 		}
-	private:
-		TRange								range;
-		TFunction							function;
-		std::shared_ptr<inner_range_type>	inner_range;
-	};
 
-	template<typename TRange>
-	class ref_range
-	{
-	public:
-		typedef typename std::reference_wrapper<typename const TRange::value_type > value_type;
-		typedef value_type															return_type;
-		ref_range(const TRange& _range)
-			:range(_range)
-		{}
+		range_size size_hint() const
+		{
+			return size_hint(iterator_category());
+		}
 
-		bool next()
+		//random access only: drop the next n elements as if next() was called n times
+		void advance(size_t n)
 		{
-			return range.next();
+			beg += std::min(n, size_hint().count);
 		}
 
-		return_type front()
+		//random access only: the element the (n+1)th call of next() would visit
+		return_type at(size_t n)
 		{
-			return range.front();
+			return beg[n + (is_first_visit ? 0 : 1)];
 		}
-	private:
-		TRange range;
-	};
 
-	template<typename TRange>
-	class take_range
-	{
-	public:
-		typedef typename TRange::value_type		value_type;
-		typedef typename TRange::return_type	return_type;
+		//number of positions slice() can cut the rest of the range at, 1 when it cannot be split
+		size_t split_size() const
+		{
+			return split_size(is_random_access());
+		}
 
-		take_range(const TRange& _range, int _count)
-			:range(_range)
-			,count(_count)
-		{}
+		//contiguous iterators only: the element the next call of next() would visit, NULL when none is left
+		const value_type* data() const
+		{
+			TIterator first = beg;
+			if (!is_first_visit && beg != end)
+				++first;
+			return first == end ? NULL : &*first;
+		}
 
-		bool next()
+		//the rest of the range restricted to positions [from, to), for parallel evaluation
+		slice_type slice(size_t from, size_t to) const
+		{
+			return slice(from, to, is_random_access());
+		}
+
+	protected:
+		size_t split_size(std::true_type) const
+		{
+			return size_hint().count;
+		}
+
+		size_t split_size(std::false_type) const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t from, size_t to, std::true_type) const
+		{
+			TIterator first = beg;
+			if (!is_first_visit && beg != end)
+				++first;
+			return basic_range(first + from, first + to);
+		}
+
+		slice_type slice(size_t, size_t, std::false_type) const
+		{
+			return *this;
+		}
+
+		size_t next_batch(const value_type*& values, value_type*, size_t n, std::true_type)
+		{
+			size_t ret = std::min(n, static_cast<size_t>(end - beg));
+			values = ret > 0 ? &*beg : NULL;
+			beg += ret;
+			return ret;
+		}
+
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n, std::false_type)
+		{
+			size_t ret = 0;
+			for (; ret < n && beg != end; ++ret, ++beg)
+			{
+				buffer[ret] = *beg;
+			}
+			values = buffer;
+			return ret;
+		}
+
+		range_size size_hint(std::random_access_iterator_tag) const
+		{
+			if (beg == end) return range_size::exact(0);
+			return range_size::exact(static_cast<size_t>(end - beg) - (is_first_visit ? 0 : 1));
+		}
+
+		range_size size_hint(std::input_iterator_tag) const
+		{
+			if (beg == end) return range_size::exact(0);
+			return range_size::unknown();
+		}
+
+
+		TIterator	beg;
+		TIterator	end;
+		bool		is_first_visit;
+	};
+
+	template<class unknow>
+	class DebugClass;
+
+	//ownership of the container behind a storage_range:
+	//unique_storage	one range owns it and moving hands the ownership on; copies borrow the container like
+	//					from() borrows, no count at all, and must not outlive the range that owns it
+	//shared_storage	copies share the container through an atomic reference count, safe to copy across threads
+	//local_storage		copies share the container through a plain reference count, for single threaded use
+	struct unique_storage
+	{
+	};
+
+	struct shared_storage
+	{
+	};
+
+	struct local_storage
+	{
+	};
+
+	template<typename TContainer, typename TOwnership>
+	class storage_holder;
+
+	template<typename TContainer>
+	class storage_holder<TContainer, unique_storage>
+	{
+	public:
+		template<typename TArg>
+		explicit storage_holder(TArg&& value)
+			:container(new TContainer(std::forward<TArg>(value)))
+			,owner(true)
+		{}
+
+		storage_holder(const storage_holder& other)
+			:container(other.container)
+			,owner(false)
+		{}
+
+		storage_holder(storage_holder&& other)
+			:container(other.container)
+			,owner(other.owner)
+		{
+			other.owner = false;
+		}
+
+		storage_holder& operator=(storage_holder other)
+		{
+			std::swap(container, other.container);
+			std::swap(owner, other.owner);
+			return *this;
+		}
+
+		~storage_holder()
+		{
+			if (owner)
+				delete container;
+		}
+
+		TContainer& get() const
+		{
+			return *container;
+		}
+
+		//false for a copy that only borrows the container
+		bool owns() const
+		{
+			return owner;
+		}
+
+	private:
+		TContainer*	container;
+		bool		owner;
+	};
+
+	template<typename TContainer>
+	class storage_holder<TContainer, shared_storage>
+	{
+	public:
+		template<typename TArg>
+		explicit storage_holder(TArg&& value)
+			:container(std::make_shared<TContainer>(std::forward<TArg>(value)))
+		{}
+
+		TContainer& get() const
+		{
+			return *container;
+		}
+
+	private:
+		std::shared_ptr<TContainer>	container;
+	};
+
+	template<typename TContainer>
+	class storage_holder<TContainer, local_storage>
+	{
+	public:
+		template<typename TArg>
+		explicit storage_holder(TArg&& value)
+			:block(new counted(std::forward<TArg>(value)))
+		{}
+
+		storage_holder(const storage_holder& other)
+			:block(other.block)
+		{
+			++block->count;
+		}
+
+		storage_holder(storage_holder&& other)
+			:block(other.block)
+		{
+			other.block = NULL;
+		}
+
+		storage_holder& operator=(storage_holder other)
+		{
+			std::swap(block, other.block);
+			return *this;
+		}
+
+		~storage_holder()
+		{
+			if (block && --block->count == 0)
+				delete block;
+		}
+
+		TContainer& get() const
+		{
+			return block->container;
+		}
+
+	private:
+		struct counted
+		{
+			template<typename TArg>
+			explicit counted(TArg&& value)
+				:container(std::forward<TArg>(value))
+				,count(1)
+			{}
+
+			TContainer	container;
+			size_t		count;
+		};
+
+		counted*	block;
+	};
+
+	template<typename TContainer, typename TOwnership = unique_storage>
+	class storage_range
+	{
+	public:
+		typedef typename extract_iterator_type<TContainer>::type iterator_type;
+		typedef typename basic_range<iterator_type>::value_type	value_type;
+		typedef typename basic_range<iterator_type>::return_type	return_type;
+		typedef typename basic_range<iterator_type>::is_random_access	is_random_access;
+		typedef basic_range<iterator_type>								slice_type;
+		typedef storage_holder<TContainer, TOwnership>					holder_type;
+
+	public:
+		storage_range(const TContainer& _container)
+			:container(_container)
+			,range(basic_range<iterator_type>(container.get().begin(), container.get().end()))
+		{
+		}
+
+		storage_range(TContainer&& _container)
+			:container(std::move(_container))
+			,range(basic_range<iterator_type>(container.get().begin(), container.get().end()))
+		{
+		}
+
+		//copies read the same container, from the same position
+		storage_range(const storage_range& other)
+			:container(other.container)
+			,range(other.range)
+		{
+		}
+
+		//the container's heap block moves along, so the iterators stay valid
+		storage_range(storage_range&& other)
+			:container(std::move(other.container))
+			,range(other.range)
+		{
+		}
+
+		storage_range& operator=(storage_range other)
+		{
+			container = std::move(other.container);
+			range = other.range;
+			return *this;
+		}
+
+		bool next()
+		{
+			return range.next();
+		}
+
+		return_type front()
+		{
+			return range.front();
+		}
+
+		bool next_back()
+		{
+			return range.next_back();
+		}
+
+		return_type back()
+		{
+			return range.back();
+		}
+
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			return range.next_batch(values, buffer, n);
+		}
+
+		range_size size_hint() const
+		{
+			return range.size_hint();
+		}
+
+		void advance(size_t n)
+		{
+			range.advance(n);
+		}
+
+		return_type at(size_t n)
+		{
+			return range.at(n);
+		}
+
+		size_t split_size() const
+		{
+			return range.split_size();
+		}
+
+		const value_type* data() const
+		{
+			return range.data();
+		}
+
+		//slices borrow the container, they must not outlive this range
+		slice_type slice(size_t from, size_t to) const
+		{
+			return range.slice(from, to);
+		}
+
+		//unique_storage only: whether this copy owns the container or borrows it
+		bool owns_container() const
+		{
+			return container.owns();
+		}
+
+	private:
+		holder_type					container;
+		basic_range<iterator_type>	range;
+	};
+
+	//range over a container held by value inside the range itself, no heap of its own.
+	//copies copy the container and resume at the same position
+	template<typename TContainer>
+	class owned_range
+	{
+	public:
+		typedef typename extract_iterator_type<TContainer>::type		iterator_type;
+		typedef typename basic_range<iterator_type>::value_type			value_type;
+		typedef typename basic_range<iterator_type>::return_type		return_type;
+
+	public:
+		owned_range()
+			:range(container.begin(), container.end())
+			,visited(0)
+		{
+		}
+
+		owned_range(const owned_range& other)
+			:container(other.container)
+			,range(container.begin(), container.end())
+			,visited(0)
+		{
+			resume(other.visited);
+		}
+
+		owned_range& operator=(const owned_range& other)
+		{
+			if (this != &other)
+			{
+				container = other.container;
+				range = basic_range<iterator_type>(container.begin(), container.end());
+				visited = 0;
+				resume(other.visited);
+			}
+			return *this;
+		}
+
+		//takes over the elements (and allocation) of value, positioned before its first element
+		void assign(TContainer&& value)
+		{
+			container = std::move(value);
+			range = basic_range<iterator_type>(container.begin(), container.end());
+			visited = 0;
+		}
+
+		bool next()
+		{
+			if (!range.next())
+				return false;
+			++visited;
+			return true;
+		}
+
+		return_type front()
+		{
+			return range.front();
+		}
+
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			size_t ret = range.next_batch(values, buffer, n);
+			visited += ret;
+			return ret;
+		}
+
+	private:
+		void resume(size_t count)
+		{
+			while (visited < count && next())
+			{
+			}
+		}
+
+		TContainer					container;
+		basic_range<iterator_type>	range;
+		size_t						visited;
+	};
+
+	template<typename TRange, typename TFunction>
+	class where_range {
+	public:
+		typedef typename TRange::value_type		value_type;
+		typedef typename TRange::return_type	return_type;
+		typedef std::false_type					is_random_access;
+		typedef where_range<typename TRange::slice_type, TFunction>	slice_type;
+
+		where_range(TRange _range, TFunction _predicate)
+			:range(std::move(_range))
+			,predicate(std::move(_predicate)) {
+		}
+
+		bool next()
+		{
+			while (range.next())
+			{
+				if (predicate(range.front()))
+					return true;
+			}
+			return false;
+		}
+
+		return_type front()
+		{
+			return range.front();
+		}
+
+		//survivors are compacted into buffer, pulling again until at least half of it is filled
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			size_t ret = 0;
+			while (ret == 0 || ret < n / 2)
+			{
+				const value_type* source = NULL;
+				size_t got = pull_batch(range, source, buffer + ret, n - ret);
+				if (got == 0)
+					break;
+				ret = compact(source, got, buffer, ret, std::is_trivially_copyable<value_type>());
+			}
+			values = buffer;
+			return ret;
+		}
+
+		range_size size_hint() const
+		{
+			return range_size::at_most(range.size_hint().count);
+		}
+
+		size_t split_size() const
+		{
+			return range.split_size();
+		}
+
+		slice_type slice(size_t from, size_t to) const
+		{
+			return slice_type(range.slice(from, to), predicate);
+		}
+
+		const TRange& source_range() const
+		{
+			return range;
+		}
+
+		const TFunction& predicate_function() const
+		{
+			return predicate;
+		}
+
+	private:
+		//source may be buffer + ret itself, writes never overtake reads
+		size_t compact(const value_type* source, size_t n, value_type* buffer, size_t ret, std::true_type)
+		{
+			for (size_t i = 0; i < n; ++i)
+			{
+				bool keep = predicate(source[i]);
+				buffer[ret] = source[i];
+				ret += keep ? 1 : 0;
+			}
+			return ret;
+		}
+
+		size_t compact(const value_type* source, size_t n, value_type* buffer, size_t ret, std::false_type)
+		{
+			for (size_t i = 0; i < n; ++i)
+			{
+				if (predicate(source[i]))
+				{
+					if (buffer + ret != source + i)
+						buffer[ret] = source[i];
+					++ret;
+				}
+			}
+			return ret;
+		}
+
+		TRange		range;
+		TFunction	predicate;
+	};
+
+	template<typename TRange, typename TFunction>
+	class select_range
+	{
+	public:
+		typedef typename extract_return_type<TFunction,typename TRange::return_type>::type						raw_value_type;
+		typedef typename cleanup_type<raw_value_type>::type												value_type;
+		typedef const value_type&																return_type;
+		typedef typename TRange::is_random_access												is_random_access;
+		typedef select_range<typename TRange::slice_type, TFunction>							slice_type;
+
+		select_range(TRange _range, TFunction _function)
+			:range(std::move(_range))
+			,function(std::move(_function))
+		{}
+
+		bool next()
+		{
+			current.reset();
+			return range.next();
+		}
+
+		//function runs once per element, the reference stays valid until the next call of next()
+		return_type front()
+		{
+			if (!current.engaged())
+				current.emplace(function(range.front()));
+			return current.get();
+		}
+
+		bool next_back()
+		{
+			current.reset();
+			return range.next_back();
+		}
+
+		return_type back()
+		{
+			if (!current.engaged())
+				current.emplace(function(range.back()));
+			return current.get();
+		}
+
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			return next_batch(values, buffer, n, std::integral_constant<bool, is_batchable<typename TRange::value_type>::value>());
+		}
+
+		range_size size_hint() const
+		{
+			return range.size_hint();
+		}
+
+		void advance(size_t n)
+		{
+			current.reset();
+			range.advance(n);
+		}
+
+		return_type at(size_t n)
+		{
+			return indexed.emplace(function(range.at(n)));
+		}
+
+		size_t split_size() const
+		{
+			return range.split_size();
+		}
+
+		slice_type slice(size_t from, size_t to) const
+		{
+			return slice_type(range.slice(from, to), function);
+		}
+	private:
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n, std::true_type)
+		{
+			current.reset();
+			if (source_buffer.size() < n)
+				source_buffer.resize(n);
+			const typename TRange::value_type* source = NULL;
+			size_t ret = pull_batch(range, source, &source_buffer[0], n);
+			for (size_t i = 0; i < ret; ++i)
+			{
+				buffer[i] = function(source[i]);
+			}
+			values = buffer;
+			return ret;
+		}
+
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n, std::false_type)
+		{
+			return pull_each(*this, values, buffer, n);
+		}
+
+		TRange									range;
+		TFunction								function;
+		cached_value<value_type>				current;
+		cached_value<value_type>				indexed;
+		std::vector<typename TRange::value_type>	source_buffer;
+	};
+
+	template<typename TRange, typename TFunction>
+	struct select_many_range_helper
+	{
+		typedef typename extract_return_type<TFunction, typename TRange::return_type>::type						inner_data_type;
+		typedef typename cleanup_type<inner_data_type>::type													clean_inner_data_type;
+		typedef typename extract_iterator_type<inner_data_type>::type											inner_data_iterator_type;
+	
+		typedef typename std::conditional <
+			std::is_lvalue_reference<inner_data_type>::value,
+			basic_range<inner_data_iterator_type>,
+			owned_range < clean_inner_data_type >> ::type inner_range_type;
+	};
+
+	template<typename TRange, typename TFunction>
+	class select_many_range
+	{
+	public:
+
+		typedef	typename select_many_range_helper<TRange, TFunction>::inner_data_type										inner_data_type;
+		typedef	typename select_many_range_helper<TRange, TFunction>::inner_data_iterator_type							inner_data_iterator_type;
+		typedef	typename select_many_range_helper<TRange, TFunction>::inner_range_type							inner_range_type;
+
+		typedef typename extract_range_trait<inner_range_type>::value_type value_type;
+		typedef typename extract_range_trait<inner_range_type>::return_type return_type;
+		typedef std::false_type												is_random_access;
+		typedef select_many_range											slice_type;
+		select_many_range(TRange _range, TFunction _function)
+			:range(std::move(_range))
+			,function(std::move(_function))
+		{
+		}
+
+		//empty inner containers are skipped
+		bool next()
+		{
+			while (!inner_range.next())
+			{
+				if (!range.next())
+					return false;
+				assign_inner(function(range.front()), std::is_lvalue_reference<inner_data_type>());
+			}
+			return true;
+		}
+
+		return_type front()
+		{
+			return inner_range.front();
+		}
+
+		//a batch never spans two inner containers, so a contiguous one is handed out from its own storage
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			for (;;)
+			{
+				size_t ret = pull_batch(inner_range, values, buffer, n);
+				if (ret > 0 || !range.next())
+					return ret;
+				assign_inner(function(range.front()), std::is_lvalue_reference<inner_data_type>());
+			}
+		}
+
+		range_size size_hint() const
+		{
+			return range_size::unknown();
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+	private:
+		//the inner range lives in the stage: a view of a referenced container, or the returned container moved in
+		void assign_inner(inner_data_type&& ref, std::true_type)
+		{
+			inner_range = inner_range_type(std::begin(ref), std::end(ref));
+		}
+
+		void assign_inner(inner_data_type&& ref, std::false_type)
+		{
+			inner_range.assign(std::move(ref));
+		}
+
+		TRange								range;
+		TFunction							function;
+		inner_range_type					inner_range;
+	};
+
+	template<typename TRange>
+	struct has_element_references;
+
+	//reference_wrappers to the elements themselves: the source must hand out references to elements
+	//that outlive next(), not to a value a stage computed for its current position
+	template<typename TRange>
+	class ref_range
+	{
+	public:
+		typedef typename std::reference_wrapper<typename const TRange::value_type > value_type;
+		typedef value_type															return_type;
+		typedef typename TRange::is_random_access									is_random_access;
+		typedef ref_range<typename TRange::slice_type>								slice_type;
+		ref_range(TRange _range)
+			:range(std::move(_range))
+		{}
+
+		bool next()
+		{
+			return range.next();
+		}
+
+		return_type front()
+		{
+			static_assert(has_element_references<TRange>::value, "ref(): the source hands out values it computed, not references to its elements");
+			return range.front();
+		}
+
+		bool next_back()
+		{
+			return range.next_back();
+		}
+
+		return_type back()
+		{
+			static_assert(has_element_references<TRange>::value, "ref(): the source hands out values it computed, not references to its elements");
+			return range.back();
+		}
+
+		range_size size_hint() const
+		{
+			return range.size_hint();
+		}
+
+		void advance(size_t n)
+		{
+			range.advance(n);
+		}
+
+		return_type at(size_t n)
+		{
+			static_assert(has_element_references<TRange>::value, "ref(): the source hands out values it computed, not references to its elements");
+			return range.at(n);
+		}
+
+		size_t split_size() const
+		{
+			return range.split_size();
+		}
+
+		slice_type slice(size_t from, size_t to) const
+		{
+			return slice_type(range.slice(from, to));
+		}
+	private:
+		TRange range;
+	};
+
+	template<typename TRange>
+	class take_range
+	{
+	public:
+		typedef typename TRange::value_type			value_type;
+		typedef typename TRange::return_type		return_type;
+		typedef typename TRange::is_random_access	is_random_access;
+		typedef typename std::conditional<
+			is_random_access::value,
+			typename TRange::slice_type,
+			take_range>::type						slice_type;
+
+		take_range(TRange _range, int _count)
+			:range(std::move(_range))
+			,count(_count)
+		{}
+
+		const TRange& source_range() const
+		{
+			return range;
+		}
+
+		bool next()
 		{
 			if (count > 0)
 			{
-				--count;
-				return range.next();
+				--count;
+				return range.next();
+			}
+			else
+			{
+				return false;
+			}
+		}
+
+		return_type front()
+		{
+			return range.front();
+		}
+
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			if (count <= 0)
+				return 0;
+			size_t ret = pull_batch(range, values, buffer, std::min(n, static_cast<size_t>(count)));
+			count -= static_cast<int>(ret);
+			return ret;
+		}
+
+		range_size size_hint() const
+		{
+			return range.size_hint().clamp(count > 0 ? count : 0);
+		}
+
+		void advance(size_t n)
+		{
+			n = std::min(n, static_cast<size_t>(count > 0 ? count : 0));
+			range.advance(n);
+			count -= static_cast<int>(n);
+		}
+
+		return_type at(size_t n)
+		{
+			return range.at(n);
+		}
+
+		size_t split_size() const
+		{
+			return split_size(is_random_access());
+		}
+
+		slice_type slice(size_t from, size_t to) const
+		{
+			return slice(from, to, is_random_access());
+		}
+	private:
+		size_t split_size(std::true_type) const
+		{
+			return std::min(range.split_size(), static_cast<size_t>(count > 0 ? count : 0));
+		}
+
+		size_t split_size(std::false_type) const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t from, size_t to, std::true_type) const
+		{
+			return range.slice(from, to);
+		}
+
+		slice_type slice(size_t, size_t, std::false_type) const
+		{
+			return *this;
+		}
+
+		TRange	range;
+		int		count;
+	};
+
+	template<typename TRange>
+	class skip_range
+	{
+	public:
+		typedef typename TRange::value_type			value_type;
+		typedef typename TRange::return_type		return_type;
+		typedef typename TRange::is_random_access	is_random_access;
+		typedef typename std::conditional<
+			is_random_access::value,
+			typename TRange::slice_type,
+			skip_range>::type						slice_type;
+
+		skip_range(TRange _range, size_t _count)
+			:range(std::move(_range))
+			,count(_count)
+		{}
+
+		const TRange& source_range() const
+		{
+			return range;
+		}
+
+		bool next()
+		{
+			skip_pending(is_random_access());
+			return range.next();
+		}
+
+		return_type front()
+		{
+			return range.front();
+		}
+
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			skip_pending(is_random_access());
+			return pull_batch(range, values, buffer, n);
+		}
+
+		range_size size_hint() const
+		{
+			range_size hint = range.size_hint();
+			if (!hint.is_known())
+				return hint;
+			size_t rest = hint.count - std::min(hint.count, count);
+			return hint.is_exact ? range_size::exact(rest) : range_size::at_most(rest);
+		}
+
+		void advance(size_t n)
+		{
+			skip_pending(is_random_access());
+			range.advance(n);
+		}
+
+		return_type at(size_t n)
+		{
+			skip_pending(is_random_access());
+			return range.at(n);
+		}
+
+		size_t split_size() const
+		{
+			return split_size(is_random_access());
+		}
+
+		slice_type slice(size_t from, size_t to) const
+		{
+			return slice(from, to, is_random_access());
+		}
+	private:
+		size_t split_size(std::true_type) const
+		{
+			size_t size = range.split_size();
+			return size - std::min(size, count);
+		}
+
+		size_t split_size(std::false_type) const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t from, size_t to, std::true_type) const
+		{
+			return range.slice(from + count, to + count);
+		}
+
+		slice_type slice(size_t, size_t, std::false_type) const
+		{
+			return *this;
+		}
+
+		void skip_pending(std::true_type)
+		{
+			range.advance(count);
+			count = 0;
+		}
+
+		void skip_pending(std::false_type)
+		{
+			for (; count > 0; --count)
+			{
+				if (!range.next())
+				{
+					count = 0;
+					return;
+				}
+			}
+		}
+
+		TRange	range;
+		size_t	count;
+	};
+
+	//a handful of values stored in the range itself, behind single(), just() and concat(value)
+	template<typename TValue, size_t N>
+	class inline_range
+	{
+	public:
+		typedef TValue				value_type;
+		typedef const value_type&	return_type;
+		typedef std::true_type		is_random_access;
+		typedef inline_range		slice_type;
+
+		explicit inline_range(const std::array<TValue, N>& _values)
+			:values(_values)
+			,pending(0)
+			,last(N)
+		{}
+
+		explicit inline_range(std::array<TValue, N>&& _values)
+			:values(std::move(_values))
+			,pending(0)
+			,last(N)
+		{}
+
+		bool next()
+		{
+			if (pending == last)
+				return false;
+			++pending;
+			return true;
+		}
+
+		return_type front()
+		{
+			return values[pending - 1];
+		}
+
+		bool next_back()
+		{
+			if (pending == last)
+				return false;
+			--last;
+			return true;
+		}
+
+		return_type back()
+		{
+			return values[last];
+		}
+
+		size_t next_batch(const value_type*& out, value_type*, size_t n)
+		{
+			size_t ret = std::min(n, last - pending);
+			out = ret > 0 ? &values[pending] : NULL;
+			pending += ret;
+			return ret;
+		}
+
+		range_size size_hint() const
+		{
+			return range_size::exact(last - pending);
+		}
+
+		void advance(size_t n)
+		{
+			pending += std::min(n, last - pending);
+		}
+
+		return_type at(size_t n)
+		{
+			return values[pending + n];
+		}
+
+		size_t split_size() const
+		{
+			return last - pending;
+		}
+
+		slice_type slice(size_t from, size_t to) const
+		{
+			inline_range ret = *this;
+			ret.pending = pending + from;
+			ret.last = pending + to;
+			return ret;
+		}
+
+		const value_type* data() const
+		{
+			return pending < last ? &values[pending] : NULL;
+		}
+
+	private:
+		std::array<TValue, N>	values;
+		size_t					pending;
+		size_t					last;
+	};
+
+	template<typename TRange,typename TOtherRange>
+	class concat_range
+	{
+	public:
+		typedef typename TRange::value_type			value_type;
+		typedef typename TRange::return_type	return_type;
+		typedef std::false_type					is_random_access;
+		typedef concat_range					slice_type;
+
+		concat_range(TRange _range, TOtherRange _other_range)
+			:range(std::move(_range))
+			,other_range(std::move(_other_range))
+			,is_visit_first_range(true)
+		{}
+
+		const TRange& source_range() const
+		{
+			return range;
+		}
+
+		const TOtherRange& appended_range() const
+		{
+			return other_range;
+		}
+
+		bool next()
+		{
+			if (range.next())
+			{
+				return true;
+			}
+
+			if (other_range.next())
+			{
+				is_visit_first_range = false;
+				return true;
+			}
+
+			return false;		
+		}
+
+		return_type front()
+		{
+			if (is_visit_first_range)
+				return range.front();
+			else
+				return other_range.front();
+		}
+
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			return next_batch(values, buffer, n, std::is_same<value_type, typename TOtherRange::value_type>());
+		}
+
+		range_size size_hint() const
+		{
+			return range.size_hint() + other_range.size_hint();
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+	private:
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n, std::true_type)
+		{
+			size_t ret = is_visit_first_range ? pull_batch(range, values, buffer, n) : 0;
+			if (ret == 0)
+			{
+				ret = pull_batch(other_range, values, buffer, n);
+				is_visit_first_range = false;
+			}
+			return ret;
+		}
+
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n, std::false_type)
+		{
+			return pull_each(*this, values, buffer, n);
+		}
+
+		TRange		range;
+		TOtherRange	other_range;
+		bool		is_visit_first_range;
+	};
+
+	template<typename TRange>
+	struct owns_elements;
+
+	template<typename TRange>
+	struct has_stable_elements;
+
+	//no further sort keys after the first one
+	struct order_then_none
+	{
+		template<typename TValue>
+		void compute(const std::vector<TValue>&)
+		{
+		}
+
+		int compare(size_t, size_t) const
+		{
+			return 0;
+		}
+	};
+
+	//a then_by key: computed once per element, consulted only when the earlier keys tie
+	template<typename TParent, typename TKeySelector, typename TValue>
+	class order_then_key
+	{
+	public:
+		typedef typename cleanup_type<typename extract_return_type<TKeySelector, TValue>::type>::type	key_type;
+
+		order_then_key(TParent _parent, TKeySelector _key_selector, bool _descending)
+			:parent(std::move(_parent))
+			,key_selector(std::move(_key_selector))
+			,descending(_descending)
+		{}
+
+		void compute(const std::vector<TValue>& elements)
+		{
+			parent.compute(elements);
+			keys.reserve(elements.size());
+			for (size_t i = 0; i < elements.size(); ++i)
+			{
+				keys.push_back(key_selector(elements[i]));
+			}
+		}
+
+		int compare(size_t a, size_t b) const
+		{
+			int ret = parent.compare(a, b);
+			if (ret != 0)
+				return ret;
+			if (keys[a] < keys[b])
+				return descending ? 1 : -1;
+			if (keys[b] < keys[a])
+				return descending ? -1 : 1;
+			return 0;
+		}
+
+	private:
+		TParent					parent;
+		TKeySelector			key_selector;
+		bool					descending;
+		std::vector<key_type>	keys;
+	};
+
+	//order_by: the source is drained on the first next() and every key is computed once per element.
+	//(first key, index) pairs are then sorted incrementally, quickselect style, only as far as the
+	//elements pulled so far, which are handed out through them without being moved.
+	//ties keep the source order
+	template<typename TRange, typename TKeySelector, typename TThen = order_then_none>
+	class order_range
+	{
+	public:
+		typedef typename TRange::value_type		value_type;
+		typedef const value_type&				return_type;
+		typedef std::false_type					is_random_access;
+		typedef order_range						slice_type;
+		typedef typename cleanup_type<typename extract_return_type<TKeySelector, value_type>::type>::type	key_type;
+
+		order_range(TRange _range, TKeySelector _key_selector, bool _descending, TThen _then_keys = TThen())
+			:range(std::move(_range))
+			,key_selector(std::move(_key_selector))
+			,descending(_descending)
+			,then_keys(std::move(_then_keys))
+			,evaluated(false)
+			,position(0)
+			,sorted_end(0)
+		{}
+
+		//the same ordering with one more key to break ties, built from this range's parts
+		template<typename TFunction>
+		order_range<TRange, TKeySelector, order_then_key<TThen, TFunction, value_type>> then_by(TFunction function, bool then_descending)
+		{
+			typedef order_then_key<TThen, TFunction, value_type> then_type;
+			return order_range<TRange, TKeySelector, then_type>(
+				std::move(range),
+				std::move(key_selector),
+				descending,
+				then_type(std::move(then_keys), std::move(function), then_descending));
+		}
+
+		bool next()
+		{
+			if (!evaluated)
+				evaluate();
+			if (position == order.size())
+				return false;
+			settle(position);
+			++position;
+			return true;
+		}
+
+		return_type front()
+		{
+			return elements[order[position - 1].index];
+		}
+
+		//the keys were computed up front and each element is handed out once, so a batch moves them out
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			size_t ret = 0;
+			while (ret < n && next())
+			{
+				buffer[ret++] = std::move(elements[order[position - 1].index]);
+			}
+			values = buffer;
+			return ret;
+		}
+
+		range_size size_hint() const
+		{
+			return evaluated ? range_size::exact(order.size() - position) : range.size_hint();
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+
+	private:
+		struct entry
+		{
+			key_type	key;
+			size_t		index;
+		};
+
+		struct entry_less
+		{
+			entry_less(const order_range& _owner)
+				:owner(_owner)
+			{}
+
+			bool operator()(const entry& a, const entry& b) const
+			{
+				if (a.key < b.key)
+					return !owner.descending;
+				if (b.key < a.key)
+					return owner.descending;
+				int ret = owner.then_keys.compare(a.index, b.index);
+				if (ret != 0)
+					return ret < 0;
+				return a.index < b.index;
+			}
+
+			const order_range& owner;
+		};
+
+		void evaluate()
+		{
+			evaluated = true;
+			drain(std::integral_constant<bool, is_batchable<value_type>::value>());
+
+			order.reserve(elements.size());
+			for (size_t i = 0; i < elements.size(); ++i)
+			{
+				entry e = {key_selector(elements[i]), i};
+				order.push_back(std::move(e));
+			}
+			then_keys.compute(elements);
+			bounds.push_back(order.size());
+		}
+
+		//put the entry belonging at index in place. bounds holds the positions of the pivots placed
+		//so far, innermost last: everything before a pivot sorts before it
+		void settle(size_t index)
+		{
+			if (index < sorted_end)
+				return;
+
+			entry_less less(*this);
+			for (;;)
+			{
+				size_t last = bounds.back();
+				if (last == index)
+				{
+					bounds.pop_back();
+					sorted_end = index + 1;
+					return;
+				}
+
+				//short runs, and inputs that keep defeating the pivot choice, are sorted outright
+				if (last - index <= 16 || bounds.size() > 2 * 64)
+				{
+					std::sort(order.begin() + index, order.begin() + last, less);
+					sorted_end = last;
+					return;
+				}
+
+				size_t middle = index + (last - index) / 2;
+				size_t pivot = median_of_three(index, middle, last - 1, less);
+				std::swap(order[pivot], order[last - 1]);
+				const entry& pivot_entry = order[last - 1];
+				auto split = std::partition(order.begin() + index, order.begin() + last - 1, [&](const entry& e)
+				{
+					return less(e, pivot_entry);
+				});
+				std::swap(*split, order[last - 1]);
+				bounds.push_back(split - order.begin());
+			}
+		}
+
+		size_t median_of_three(size_t a, size_t b, size_t c, const entry_less& less) const
+		{
+			if (less(order[a], order[b]))
+				return less(order[b], order[c]) ? b : (less(order[a], order[c]) ? c : a);
+			return less(order[a], order[c]) ? a : (less(order[b], order[c]) ? c : b);
+		}
+
+		//elements in the batch buffer, or owned by the source alone, are moved in
+		void drain(std::true_type)
+		{
+			range_size hint = range.size_hint();
+			if (hint.is_exact)
+				elements.reserve(hint.count);
+			bool owned = elements_owned(range);
+			std::vector<value_type> buffer(batch_size);
+			const value_type* values = NULL;
+			size_t n;
+			while ((n = pull_batch(range, values, &buffer[0], batch_size)) > 0)
+			{
+				if (owned || values == &buffer[0])
+				{
+					value_type* first = const_cast<value_type*>(values);
+					elements.insert(elements.end(), std::make_move_iterator(first), std::make_move_iterator(first + n));
+				}
+				else
+				{
+					elements.insert(elements.end(), values, values + n);
+				}
+			}
+		}
+
+		void drain(std::false_type)
+		{
+			while (range.next())
+			{
+				elements.push_back(range.front());
+			}
+		}
+
+		TRange						range;
+		TKeySelector				key_selector;
+		bool						descending;
+		TThen						then_keys;
+		bool						evaluated;
+		std::vector<value_type>		elements;
+		std::vector<entry>			order;
+		std::vector<size_t>			bounds;
+		size_t						position;
+		size_t						sorted_end;
+	};
+
+	//the range then_by turns an order_range into, other ranges have none
+	template<typename TRange, typename TFunction>
+	struct then_by_range;
+
+	template<typename TRange, typename TKeySelector, typename TThen, typename TFunction>
+	struct then_by_range<order_range<TRange, TKeySelector, TThen>, TFunction>
+	{
+		typedef order_range<TRange, TKeySelector, order_then_key<TThen, TFunction, typename TRange::value_type>> type;
+	};
+
+	//finalizer so that identity hashes (std::hash<int>) spread over every bit
+	inline size_t mix_hash(size_t value)
+	{
+		unsigned long long h = value;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return static_cast<size_t>(h);
+	}
+
+	//linear probing table of (hash, entry index) slots, the entries themselves live in caller owned arrays
+	class flat_hash_index
+	{
+	public:
+		static const size_t npos = size_t(-1);
+
+		flat_hash_index()
+			:count(0)
+		{}
+
+		size_t size() const
+		{
+			return count;
+		}
+
+		void reserve(size_t n)
+		{
+			size_t capacity = 16;
+			while (capacity < n * 2)
+				capacity *= 2;
+			if (capacity > slots.size())
+				rehash(capacity);
+		}
+
+		//TEqual(entry) tells whether an entry holds the searched key
+		template<typename TEqual>
+		size_t find(size_t hash, const TEqual& equal) const
+		{
+			if (slots.empty())
+				return npos;
+
+			size_t mask = slots.size() - 1;
+			for (size_t i = hash & mask;; i = (i + 1) & mask)
+			{
+				const slot& s = slots[i];
+				if (s.entry == npos)
+					return npos;
+				if (s.hash == hash && equal(s.entry))
+					return s.entry;
+			}
+		}
+
+		//return the entry equal to the key, or register new_entry for it and return new_entry
+		template<typename TEqual>
+		size_t insert(size_t hash, size_t new_entry, const TEqual& equal)
+		{
+			if ((count + 1) * 2 > slots.size())
+				rehash(slots.empty() ? 16 : slots.size() * 2);
+
+			size_t mask = slots.size() - 1;
+			for (size_t i = hash & mask;; i = (i + 1) & mask)
+			{
+				slot& s = slots[i];
+				if (s.entry == npos)
+				{
+					s.hash = hash;
+					s.entry = new_entry;
+					++count;
+					return new_entry;
+				}
+				if (s.hash == hash && equal(s.entry))
+					return s.entry;
+			}
+		}
+
+	private:
+		struct slot
+		{
+			size_t	hash;
+			size_t	entry;
+		};
+
+		void rehash(size_t capacity)
+		{
+			std::vector<slot> old_slots(capacity);
+			for (size_t i = 0; i < capacity; ++i)
+				old_slots[i].entry = npos;
+			old_slots.swap(slots);
+
+			size_t mask = capacity - 1;
+			for (size_t i = 0; i < old_slots.size(); ++i)
+			{
+				if (old_slots[i].entry == npos)
+					continue;
+				size_t j = old_slots[i].hash & mask;
+				while (slots[j].entry != npos)
+					j = (j + 1) & mask;
+				slots[j] = old_slots[i];
+			}
+		}
+
+		std::vector<slot>	slots;
+		size_t				count;
+	};
+
+	//hash multimap filled once and then sealed: rows sharing a key end up contiguous, in insertion order
+	template<typename TKey, typename TValue, typename THash = std::hash<TKey>>
+	class flat_hash_multimap
+	{
+	public:
+		typedef const TValue*	const_iterator;
+
+		flat_hash_multimap()
+			:max_count(0)
+		{}
+
+		void reserve(size_t n)
+		{
+			values.reserve(n);
+			row_groups.reserve(n);
+		}
+
+		template<typename TLookupKey>
+		size_t hash(const TLookupKey& key) const
+		{
+			return mix_hash(hasher(key));
+		}
+
+		void insert(TKey&& key, TValue&& value)
+		{
+			insert(std::move(key), std::move(value), hash(key));
+		}
+
+		void insert(TKey&& key, TValue&& value, size_t hash)
+		{
+			size_t group = index.insert(hash, keys.size(), key_equal<TKey>(keys, key));
+			if (group == keys.size())
+			{
+				keys.push_back(std::move(key));
+				offsets.push_back(0);
+			}
+			++offsets[group];
+			row_groups.push_back(group);
+			values.push_back(std::move(value));
+		}
+
+		//group the inserted rows by key, no insert is allowed afterwards
+		void seal()
+		{
+			size_t begin = 0;
+			for (size_t g = 0; g < offsets.size(); ++g)
+			{
+				max_count = std::max(max_count, offsets[g]);
+				size_t group_count = offsets[g];
+				offsets[g] = begin;
+				begin += group_count;
+			}
+			offsets.push_back(begin);
+
+			std::vector<size_t> cursor(offsets.begin(), offsets.end() - 1);
+			std::vector<size_t> order(values.size());
+			for (size_t row = 0; row < row_groups.size(); ++row)
+				order[cursor[row_groups[row]]++] = row;
+			std::vector<size_t>().swap(row_groups);
+
+			std::vector<TValue> grouped;
+			grouped.reserve(values.size());
+			for (size_t i = 0; i < order.size(); ++i)
+				grouped.push_back(std::move(values[order[i]]));
+			values.swap(grouped);
+		}
+
+		template<typename TLookupKey>
+		std::pair<const_iterator, const_iterator> equal_range(const TLookupKey& key) const
+		{
+			return equal_range(key, hash(key));
+		}
+
+		template<typename TLookupKey>
+		std::pair<const_iterator, const_iterator> equal_range(const TLookupKey& key, size_t hash) const
+		{
+			size_t group = index.find(hash, key_equal<TLookupKey>(keys, key));
+			if (group == flat_hash_index::npos)
+				return std::pair<const_iterator, const_iterator>(NULL, NULL);
+			const_iterator data = values.data();
+			return std::make_pair(data + offsets[group], data + offsets[group + 1]);
+		}
+
+		bool empty() const
+		{
+			return values.empty();
+		}
+
+		size_t size() const
+		{
+			return values.size();
+		}
+
+		//the largest number of rows sharing one key
+		size_t max_equal_count() const
+		{
+			return max_count;
+		}
+
+	private:
+		template<typename TLookupKey>
+		struct key_equal
+		{
+			key_equal(const std::vector<TKey>& _keys, const TLookupKey& _key)
+				:keys(_keys)
+				,key(_key)
+			{}
+
+			bool operator()(size_t group) const
+			{
+				return keys[group] == key;
+			}
+
+			const std::vector<TKey>&	keys;
+			const TLookupKey&			key;
+		};
+
+		THash				hasher;
+		flat_hash_index		index;
+		std::vector<TKey>	keys;
+		std::vector<size_t>	offsets;		//per group row count while filling, group begin once sealed
+		std::vector<size_t>	row_groups;
+		std::vector<TValue>	values;
+		size_t				max_count;
+	};
+
+	//the element itself as its key, for distinct()
+	struct element_key
+	{
+		template<typename TValue>
+		const TValue& operator()(const TValue& value) const
+		{
+			return value;
+		}
+	};
+
+	//keys seen by distinct_range: copies, or addresses when the keys live in source elements that stay put
+	template<typename TKey, bool by_address>
+	class seen_keys;
+
+	template<typename TKey>
+	class seen_keys<TKey, false>
+	{
+	public:
+		size_t size() const
+		{
+			return keys.size();
+		}
+
+		const TKey& operator[](size_t i) const
+		{
+			return keys[i];
+		}
+
+		void push_back(const TKey& key)
+		{
+			keys.push_back(key);
+		}
+
+	private:
+		std::vector<TKey>	keys;
+	};
+
+	template<typename TKey>
+	class seen_keys<TKey, true>
+	{
+	public:
+		size_t size() const
+		{
+			return keys.size();
+		}
+
+		const TKey& operator[](size_t i) const
+		{
+			return *keys[i];
+		}
+
+		void push_back(const TKey& key)
+		{
+			keys.push_back(&key);
+		}
+
+	private:
+		std::vector<const TKey*>	keys;
+	};
+
+	//distinct / distinct_by: first occurrence of each key, streamed. the keys seen so far are indexed
+	//by hash in a flat_hash_index
+	template<typename TRange, typename TKeySelector>
+	class distinct_range
+	{
+	public:
+		typedef typename TRange::value_type		value_type;
+		typedef typename TRange::return_type	return_type;
+		typedef std::false_type					is_random_access;
+		typedef distinct_range					slice_type;
+		typedef typename extract_return_type<TKeySelector, value_type>::type	raw_key_type;
+		typedef typename cleanup_type<raw_key_type>::type						key_type;
+		typedef std::integral_constant<bool,
+			has_stable_elements<TRange>::value &&
+			std::is_lvalue_reference<raw_key_type>::value>						keys_by_address;
+		typedef seen_keys<key_type, keys_by_address::value>						seen_type;
+
+		distinct_range(TRange _range, TKeySelector _key_selector)
+			:range(std::move(_range))
+			,key_selector(std::move(_key_selector))
+		{}
+
+		const TRange& source_range() const
+		{
+			return range;
+		}
+
+		bool next()
+		{
+			while (range.next())
+			{
+				raw_key_type key = key_selector(range.front());
+				if (remember(key))
+					return true;
+			}
+			return false;
+		}
+
+		return_type front()
+		{
+			return range.front();
+		}
+
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			return next_batch(values, buffer, n, keys_by_address());
+		}
+
+		range_size size_hint() const
+		{
+			return range_size::at_most(range.size_hint().count);
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+
+	private:
+		//first occurrences are compacted into buffer like where_range does
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n, std::false_type)
+		{
+			size_t ret = 0;
+			while (ret == 0 || ret < n / 2)
+			{
+				const value_type* source = NULL;
+				size_t got = pull_batch(range, source, buffer + ret, n - ret);
+				if (got == 0)
+					break;
+				for (size_t i = 0; i < got; ++i)
+				{
+					raw_key_type key = key_selector(source[i]);
+					if (!remember(key))
+						continue;
+					if (buffer + ret != source + i)
+						buffer[ret] = source[i];
+					++ret;
+				}
+			}
+			values = buffer;
+			return ret;
+		}
+
+		//remembered addresses must point into the source, not into a batch buffer
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n, std::true_type)
+		{
+			return pull_each(*this, values, buffer, n);
+		}
+
+		struct seen_equal
+		{
+			seen_equal(const seen_type& _seen, const key_type& _key)
+				:seen(_seen)
+				,key(_key)
+			{}
+
+			bool operator()(size_t entry) const
+			{
+				return seen[entry] == key;
+			}
+
+			const seen_type&	seen;
+			const key_type&		key;
+		};
+
+		//true the first time key shows up
+		bool remember(const key_type& key)
+		{
+			size_t hash = mix_hash(hasher(key));
+			if (index.insert(hash, seen.size(), seen_equal(seen, key)) != seen.size())
+				return false;
+			seen.push_back(key);
+			return true;
+		}
+
+		TRange					range;
+		TKeySelector			key_selector;
+		std::hash<key_type>		hasher;
+		flat_hash_index			index;
+		seen_type				seen;
+	};
+
+	enum class set_mode
+	{
+		intersect,		//distinct elements of the first sequence found in the second
+		except,			//distinct elements of the first sequence missing from the second
+	};
+
+	//intersect_with / except, in the first sequence's order. only the side with the smaller size hint is
+	//hashed: the second one, then the first streams through it; or the first one, whose distinct elements
+	//are marked while the second streams and are handed out afterwards
+	template<typename TRange, typename TOtherRange, set_mode mode>
+	class set_operation_range
+	{
+	public:
+		typedef typename TRange::value_type		value_type;
+		typedef const value_type&				return_type;
+		typedef std::false_type					is_random_access;
+		typedef set_operation_range				slice_type;
+
+		set_operation_range(TRange _range, TOtherRange _other_range)
+			:range(std::move(_range))
+			,other_range(std::move(_other_range))
+			,built(false)
+			,build_first(false)
+			,pending(0)
+			,current(0)
+		{}
+
+		bool next()
+		{
+			if (!built)
+				build();
+			return build_first ? next_marked() : next_streamed();
+		}
+
+		return_type front()
+		{
+			return values[current];
+		}
+
+		//once the first sequence is hashed and marked nothing is looked up any more, so its elements are moved
+		//out; the streamed first sequence is filtered in place like where_range does
+		size_t next_batch(const value_type*& out, value_type* buffer, size_t n)
+		{
+			if (!built)
+				build();
+			size_t ret = 0;
+			if (build_first)
+			{
+				while (ret < n && next_marked())
+				{
+					buffer[ret++] = std::move(values[current]);
+				}
+			}
+			else
+			{
+				while (ret == 0 || ret < n / 2)
+				{
+					const value_type* source = NULL;
+					size_t got = pull_batch(range, source, buffer + ret, n - ret);
+					if (got == 0)
+						break;
+					for (size_t i = 0; i < got; ++i)
+					{
+						if (!keep_streamed(source[i]))
+							continue;
+						if (buffer + ret != source + i)
+							buffer[ret] = source[i];
+						++ret;
+					}
+				}
+			}
+			out = buffer;
+			return ret;
+		}
+
+		range_size size_hint() const
+		{
+			if (mode == set_mode::intersect)
+				return range_size::at_most(std::min(range.size_hint().count, other_range.size_hint().count));
+			return range_size::at_most(range.size_hint().count);
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+
+	private:
+		struct value_equal
+		{
+			value_equal(const std::vector<value_type>& _values, const value_type& _value)
+				:values(_values)
+				,value(_value)
+			{}
+
+			bool operator()(size_t entry) const
+			{
+				return values[entry] == value;
+			}
+
+			const std::vector<value_type>&	values;
+			const value_type&				value;
+		};
+
+		void build()
+		{
+			built = true;
+			build_first = range.size_hint().count < other_range.size_hint().count;
+			if (build_first)
+			{
+				while (range.next())
+					add(range.front());
+				while (other_range.next())
+				{
+					size_t entry = find(other_range.front());
+					if (entry != flat_hash_index::npos)
+						marks[entry] = 1;
+				}
+			}
+			else
+			{
+				while (other_range.next())
+					add(other_range.front());
+			}
+		}
+
+		bool next_marked()
+		{
+			while (pending < values.size())
+			{
+				size_t entry = pending++;
+				if ((marks[entry] != 0) == (mode == set_mode::intersect))
+				{
+					current = entry;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		//the second sequence is hashed. intersect marks what it hands out, except adds it to the table
+		bool next_streamed()
+		{
+			while (range.next())
+			{
+				if (keep_streamed(range.front()))
+					return true;
+			}
+			return false;
+		}
+
+		bool keep_streamed(const value_type& value)
+		{
+			size_t entry;
+			if (mode == set_mode::intersect)
+			{
+				entry = find(value);
+				if (entry == flat_hash_index::npos || marks[entry] != 0)
+					return false;
+				marks[entry] = 1;
+			}
+			else
+			{
+				size_t count = values.size();
+				entry = add(value);
+				if (entry != count)
+					return false;
+			}
+			current = entry;
+			return true;
+		}
+
+		size_t add(const value_type& value)
+		{
+			size_t entry = index.insert(mix_hash(hasher(value)), values.size(), value_equal(values, value));
+			if (entry == values.size())
+			{
+				values.push_back(value);
+				marks.push_back(0);
+			}
+			return entry;
+		}
+
+		size_t find(const value_type& value) const
+		{
+			return index.find(mix_hash(hasher(value)), value_equal(values, value));
+		}
+
+		TRange						range;
+		TOtherRange					other_range;
+		std::hash<value_type>		hasher;
+		flat_hash_index				index;
+		std::vector<value_type>		values;
+		std::vector<char>			marks;
+		bool						built;
+		bool						build_first;
+		size_t						pending;
+		size_t						current;
+	};
+
+	//reverse() over a range that can walk backwards (is_reversible): nothing is buffered
+	template<typename TRange>
+	class reverse_range
+	{
+	public:
+		typedef typename TRange::value_type		value_type;
+		typedef typename TRange::return_type	return_type;
+		typedef std::false_type					is_random_access;
+		typedef reverse_range					slice_type;
+
+		reverse_range(TRange _range)
+			:range(std::move(_range))
+		{}
+
+		const TRange& source_range() const
+		{
+			return range;
+		}
+
+		bool next()
+		{
+			return range.next_back();
+		}
+
+		return_type front()
+		{
+			return range.back();
+		}
+
+		range_size size_hint() const
+		{
+			return range.size_hint();
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+
+	private:
+		TRange	range;
+	};
+
+	//reverse() over any other range: the source is drained once, on the first next()
+	template<typename TRange>
+	class buffered_reverse_range
+	{
+	public:
+		typedef typename TRange::value_type		value_type;
+		typedef const value_type&				return_type;
+		typedef std::false_type					is_random_access;
+		typedef buffered_reverse_range			slice_type;
+
+		buffered_reverse_range(TRange _range)
+			:range(std::move(_range))
+			,evaluated(false)
+			,pending(0)
+		{}
+
+		bool next()
+		{
+			if (!evaluated)
+			{
+				evaluated = true;
+				range_size hint = range.size_hint();
+				if (hint.is_exact)
+					elements.reserve(hint.count);
+				while (range.next())
+					elements.push_back(range.front());
+				pending = elements.size();
+			}
+			if (pending == 0)
+				return false;
+			--pending;
+			return true;
+		}
+
+		return_type front()
+		{
+			return elements[pending];
+		}
+
+		//each buffered element is handed out once, so a batch moves them out
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			size_t ret = 0;
+			while (ret < n && next())
+			{
+				buffer[ret++] = std::move(elements[pending]);
+			}
+			values = buffer;
+			return ret;
+		}
+
+		range_size size_hint() const
+		{
+			return evaluated ? range_size::exact(pending) : range.size_hint();
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+
+	private:
+		TRange						range;
+		bool						evaluated;
+		std::vector<value_type>		elements;
+		size_t						pending;
+	};
+
+	//a group_by result: the key and its elements in query order
+	template<typename TKey, typename TValue>
+	struct grouping
+	{
+		TKey				key;
+		std::vector<TValue>	elements;
+	};
+
+	//group_by: the source is drained on the first next(), keys are looked up in a flat_hash_index
+	//over the groups, which come out in order of first appearance
+	template<typename TRange, typename TKeySelector>
+	class group_range
+	{
+	public:
+		typedef typename TRange::value_type																element_type;
+		typedef typename cleanup_type<typename extract_return_type<TKeySelector, element_type>::type>::type	key_type;
+		typedef grouping<key_type, element_type>			value_type;
+		typedef const value_type&							return_type;
+		typedef std::false_type								is_random_access;
+		typedef group_range									slice_type;
+
+		group_range(TRange _range, TKeySelector _key_selector)
+			:range(std::move(_range))
+			,key_selector(std::move(_key_selector))
+			,evaluated(false)
+			,pending(0)
+		{}
+
+		bool next()
+		{
+			if (!evaluated)
+				evaluate();
+			if (pending == groups.size())
+				return false;
+			++pending;
+			return true;
+		}
+
+		return_type front()
+		{
+			return groups[pending - 1];
+		}
+
+		//the lookups are over once the source is drained, so a batch moves the groups out instead of copying their elements
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			size_t ret = 0;
+			while (ret < n && next())
+			{
+				buffer[ret++] = std::move(groups[pending - 1]);
+			}
+			values = buffer;
+			return ret;
+		}
+
+		range_size size_hint() const
+		{
+			return evaluated ? range_size::exact(groups.size() - pending) : range_size::at_most(range.size_hint().count);
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+
+	private:
+		struct key_equal
+		{
+			key_equal(const std::vector<value_type>& _groups, const key_type& _key)
+				:groups(_groups)
+				,key(_key)
+			{}
+
+			bool operator()(size_t entry) const
+			{
+				return groups[entry].key == key;
+			}
+
+			const std::vector<value_type>&	groups;
+			const key_type&					key;
+		};
+
+		void evaluate()
+		{
+			evaluated = true;
+			while (range.next())
+			{
+				const element_type& element = range.front();
+				key_type key = key_selector(element);
+				size_t entry = index.insert(mix_hash(hasher(key)), groups.size(), key_equal(groups, key));
+				if (entry == groups.size())
+				{
+					value_type group = {std::move(key), std::vector<element_type>()};
+					groups.push_back(std::move(group));
+				}
+				groups[entry].elements.push_back(element);
+			}
+		}
+
+		TRange						range;
+		TKeySelector				key_selector;
+		std::hash<key_type>			hasher;
+		flat_hash_index				index;
+		std::vector<value_type>		groups;
+		bool						evaluated;
+		size_t						pending;
+	};
+
+	//aggregate_by: one accumulator per key folded in place, the elements themselves are not kept.
+	//yields (key, accumulator) pairs in order of first appearance
+	template<typename TRange, typename TKeySelector, typename TAccumulate, typename TAccumulateFunction>
+	class aggregate_by_range
+	{
+	public:
+		typedef typename TRange::value_type																element_type;
+		typedef typename cleanup_type<typename extract_return_type<TKeySelector, element_type>::type>::type	key_type;
+		typedef std::pair<key_type, TAccumulate>			value_type;
+		typedef const value_type&							return_type;
+		typedef std::false_type								is_random_access;
+		typedef aggregate_by_range							slice_type;
+
+		aggregate_by_range(TRange _range, TKeySelector _key_selector, TAccumulate _init, TAccumulateFunction _accumulate)
+			:range(std::move(_range))
+			,key_selector(std::move(_key_selector))
+			,init(std::move(_init))
+			,accumulate(std::move(_accumulate))
+			,evaluated(false)
+			,pending(0)
+		{}
+
+		bool next()
+		{
+			if (!evaluated)
+				evaluate();
+			if (pending == entries.size())
+				return false;
+			++pending;
+			return true;
+		}
+
+		return_type front()
+		{
+			return entries[pending - 1];
+		}
+
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			size_t ret = 0;
+			while (ret < n && next())
+			{
+				buffer[ret++] = std::move(entries[pending - 1]);
+			}
+			values = buffer;
+			return ret;
+		}
+
+		range_size size_hint() const
+		{
+			return evaluated ? range_size::exact(entries.size() - pending) : range_size::at_most(range.size_hint().count);
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+
+	private:
+		struct key_equal
+		{
+			key_equal(const std::vector<value_type>& _entries, const key_type& _key)
+				:entries(_entries)
+				,key(_key)
+			{}
+
+			bool operator()(size_t entry) const
+			{
+				return entries[entry].first == key;
+			}
+
+			const std::vector<value_type>&	entries;
+			const key_type&					key;
+		};
+
+		void evaluate()
+		{
+			evaluated = true;
+			while (range.next())
+			{
+				const element_type& element = range.front();
+				key_type key = key_selector(element);
+				size_t entry = index.insert(mix_hash(hasher(key)), entries.size(), key_equal(entries, key));
+				if (entry == entries.size())
+					entries.push_back(value_type(std::move(key), init));
+				TAccumulate& value = entries[entry].second;
+				value = accumulate(value, element);
+			}
+		}
+
+		TRange						range;
+		TKeySelector				key_selector;
+		TAccumulate					init;
+		TAccumulateFunction			accumulate;
+		std::hash<key_type>			hasher;
+		flat_hash_index				index;
+		std::vector<value_type>		entries;
+		bool						evaluated;
+		size_t						pending;
+	};
+
+	//group_adjacent: a group per run of consecutive elements with equal keys, so sorted input groups
+	//fully while only the current run is held. the run vector's capacity is reused between groups
+	template<typename TRange, typename TKeySelector>
+	class group_adjacent_range
+	{
+	public:
+		typedef typename TRange::value_type																element_type;
+		typedef typename cleanup_type<typename extract_return_type<TKeySelector, element_type>::type>::type	key_type;
+		typedef grouping<key_type, element_type>			value_type;
+		typedef const value_type&							return_type;
+		typedef std::false_type								is_random_access;
+		typedef group_adjacent_range						slice_type;
+
+		group_adjacent_range(TRange _range, TKeySelector _key_selector)
+			:range(std::move(_range))
+			,key_selector(std::move(_key_selector))
+			,started(false)
+			,has_next_key(false)
+		{}
+
+		bool next()
+		{
+			if (!started)
+			{
+				started = true;
+				has_next_key = range.next();
+			}
+			if (!has_next_key)
+				return false;
+
+			key_type key = take_next_key();
+			std::vector<element_type> elements;
+			if (current.engaged())
+			{
+				elements.swap(current.get().elements);
+				elements.clear();
+			}
+			for (;;)
+			{
+				elements.push_back(range.front());
+				has_next_key = range.next();
+				if (!has_next_key)
+					break;
+				next_key.emplace(key_selector(range.front()));
+				if (!(next_key.get() == key))
+					break;
+			}
+
+			value_type group = {std::move(key), std::move(elements)};
+			current.emplace(std::move(group));
+			return true;
+		}
+
+		return_type front()
+		{
+			return current.get();
+		}
+
+		//the runs are moved into buffer, so their vectors' capacity is not reused as next() does
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			size_t ret = 0;
+			while (ret < n && next())
+			{
+				buffer[ret++] = std::move(current.get());
+			}
+			values = buffer;
+			return ret;
+		}
+
+		//the source stands on the first element of the next run, if any; an unknown source stays unknown
+		range_size size_hint() const
+		{
+			return range_size::at_most((range.size_hint() + range_size::exact(started && has_next_key ? 1 : 0)).count);
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+
+	private:
+		//key of the element the source stands on, computed while closing the previous run
+		key_type take_next_key()
+		{
+			if (!next_key.engaged())
+				return key_selector(range.front());
+			key_type ret = std::move(next_key.get());
+			next_key.reset();
+			return ret;
+		}
+
+		TRange						range;
+		TKeySelector				key_selector;
+		optional_value<value_type>	current;		//the group handed out
+		cached_value<key_type>		next_key;
+		bool						started;
+		bool						has_next_key;
+	};
+
+	//aggregate_adjacent: aggregate_by for runs of equal keys, one accumulator at a time
+	template<typename TRange, typename TKeySelector, typename TAccumulate, typename TAccumulateFunction>
+	class aggregate_adjacent_range
+	{
+	public:
+		typedef typename TRange::value_type																element_type;
+		typedef typename cleanup_type<typename extract_return_type<TKeySelector, element_type>::type>::type	key_type;
+		typedef std::pair<key_type, TAccumulate>			value_type;
+		typedef const value_type&							return_type;
+		typedef std::false_type								is_random_access;
+		typedef aggregate_adjacent_range					slice_type;
+
+		aggregate_adjacent_range(TRange _range, TKeySelector _key_selector, TAccumulate _init, TAccumulateFunction _accumulate)
+			:range(std::move(_range))
+			,key_selector(std::move(_key_selector))
+			,init(std::move(_init))
+			,accumulate(std::move(_accumulate))
+			,started(false)
+			,has_next_key(false)
+		{}
+
+		bool next()
+		{
+			if (!started)
+			{
+				started = true;
+				has_next_key = range.next();
+			}
+			if (!has_next_key)
+				return false;
+
+			value_type entry(take_next_key(), init);
+			for (;;)
+			{
+				entry.second = accumulate(entry.second, range.front());
+				has_next_key = range.next();
+				if (!has_next_key)
+					break;
+				next_key.emplace(key_selector(range.front()));
+				if (!(next_key.get() == entry.first))
+					break;
+			}
+
+			current.emplace(std::move(entry));
+			return true;
+		}
+
+		return_type front()
+		{
+			return current.get();
+		}
+
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			size_t ret = 0;
+			while (ret < n && next())
+			{
+				buffer[ret++] = std::move(current.get());
+			}
+			values = buffer;
+			return ret;
+		}
+
+		//the source stands on the first element of the next run, if any; an unknown source stays unknown
+		range_size size_hint() const
+		{
+			return range_size::at_most((range.size_hint() + range_size::exact(started && has_next_key ? 1 : 0)).count);
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+
+	private:
+		key_type take_next_key()
+		{
+			if (!next_key.engaged())
+				return key_selector(range.front());
+			key_type ret = std::move(next_key.get());
+			next_key.reset();
+			return ret;
+		}
+
+		TRange						range;
+		TKeySelector				key_selector;
+		TAccumulate					init;
+		TAccumulateFunction			accumulate;
+		optional_value<value_type>	current;		//the pair handed out
+		cached_value<key_type>		next_key;
+		bool						started;
+		bool						has_next_key;
+	};
+
+	//distinct_until_changed: drops elements equal to the one handed out just before
+	template<typename TRange>
+	class distinct_until_changed_range
+	{
+	public:
+		typedef typename TRange::value_type		value_type;
+		typedef typename TRange::return_type	return_type;
+		typedef std::false_type					is_random_access;
+		typedef distinct_until_changed_range	slice_type;
+
+		distinct_until_changed_range(TRange _range)
+			:range(std::move(_range))
+		{}
+
+		const TRange& source_range() const
+		{
+			return range;
+		}
+
+		bool next()
+		{
+			while (range.next())
+			{
+				if (changed(range.front()))
+					return true;
+			}
+			return false;
+		}
+
+		return_type front()
+		{
+			return range.front();
+		}
+
+		//changed elements are compacted into buffer like where_range does
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			size_t ret = 0;
+			while (ret == 0 || ret < n / 2)
+			{
+				const value_type* source = NULL;
+				size_t got = pull_batch(range, source, buffer + ret, n - ret);
+				if (got == 0)
+					break;
+				for (size_t i = 0; i < got; ++i)
+				{
+					if (!changed(source[i]))
+						continue;
+					if (buffer + ret != source + i)
+						buffer[ret] = source[i];
+					++ret;
+				}
+			}
+			values = buffer;
+			return ret;
+		}
+
+		range_size size_hint() const
+		{
+			return range_size::at_most(range.size_hint().count);
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+
+	private:
+		//true when value differs from the element before it, which it then replaces
+		bool changed(const value_type& value)
+		{
+			if (!last.engaged())
+			{
+				last.emplace(value);
+				return true;
+			}
+			if (value == last.get())
+				return false;
+			last.get() = value;
+			return true;
+		}
+
+		TRange						range;
+		optional_value<value_type>	last;		//the previous element, once there is one
+	};
+
+	//containers built by the keyed sinks from key and value selectors over TRange's elements
+	template<typename TRange, typename TKeySelector, typename TValueSelector>
+	struct keyed_sink_types
+	{
+		typedef typename cleanup_type<typename extract_return_type<TKeySelector, typename TRange::value_type>::type>::type		key_type;
+		typedef typename cleanup_type<typename extract_return_type<TValueSelector, typename TRange::value_type>::type>::type	mapped_type;
+		typedef std::unordered_map<key_type, mapped_type>	unordered_map_type;
+		typedef std::map<key_type, mapped_type>				map_type;
+		typedef flat_hash_multimap<key_type, mapped_type>	lookup_type;
+	};
+
+	enum class join_mode
+	{
+		automatic,		//partitioned once the build side outgrows join_partition_threshold
+		hash,			//one hash table over the whole build side
+		partitioned,	//radix partition both sides on key hash, build and probe partition by partition
+	};
+
+	//build side bytes from which join_mode::automatic partitions, roughly a last level cache
+	const size_t join_partition_threshold = 4 << 20;
+	//target bytes per partition, so that one partition table stays in the L2 cache while probed
+	const size_t join_partition_bytes = 256 << 10;
+	//outer rows probed together in partitioned mode, per partition
+	const size_t join_probe_rows_per_partition = 64;
+
+	//build side of a join: drained into its hash tables on first use, then shared read-only by every copy
+	template<typename TOtherRange, typename TOtherKeySelector, typename TKey>
+	class join_table
+	{
+	public:
+		typedef typename TOtherRange::value_type					other_value_type;
+		typedef flat_hash_multimap<TKey, other_value_type>			map_type;
+
+		join_table(TOtherRange _other_range, TOtherKeySelector _other_key_selector, join_mode _mode)
+			:other_range(std::move(_other_range))
+			,other_key_selector(std::move(_other_key_selector))
+			,other_hint(other_range.size_hint())
+			,mode(_mode)
+			,partition_shift(0)
+			,max_count(0)
+		{}
+
+		void build_once()
+		{
+			std::call_once(built, &join_table::build, this);
+		}
+
+		//row count of the build side, known before it is built
+		range_size size_hint() const
+		{
+			return other_hint;
+		}
+
+		bool empty() const
+		{
+			return max_count == 0;
+		}
+
+		bool is_partitioned() const
+		{
+			return partitions.size() > 1;
+		}
+
+		size_t partition_count() const
+		{
+			return partitions.size();
+		}
+
+		size_t partition_of(size_t hash) const
+		{
+			return partition_shift == 0 ? 0 : hash >> partition_shift;
+		}
+
+		const map_type& partition(size_t index) const
+		{
+			return partitions[index];
+		}
+
+		size_t max_equal_count() const
+		{
+			return max_count;
+		}
+
+	private:
+		void build()
+		{
+			std::vector<TKey>				keys;
+			std::vector<other_value_type>	values;
+			if (other_hint.is_exact)
+			{
+				keys.reserve(other_hint.count);
+				values.reserve(other_hint.count);
+			}
+			while (other_range.next())
+			{
+				values.push_back(other_range.front());
+				keys.push_back(other_key_selector(values.back()));
+			}
+
+			size_t partition_bits = choose_partition_bits(values.size());
+			partition_shift = partition_bits == 0 ? 0 : sizeof(size_t) * 8 - partition_bits;
+			partitions.resize(size_t(1) << partition_bits);
+
+			std::vector<size_t> hashes(keys.size());
+			std::vector<size_t> offsets(partitions.size() + 1, 0);
+			for (size_t row = 0; row < keys.size(); ++row)
+			{
+				hashes[row] = partitions[0].hash(keys[row]);
+				++offsets[partition_of(hashes[row]) + 1];
+			}
+			for (size_t p = 0; p < partitions.size(); ++p)
+				offsets[p + 1] += offsets[p];
+
+			//scatter row ids by partition, then build one cache sized table after the other
+			std::vector<size_t> cursor(offsets.begin(), offsets.end() - 1);
+			std::vector<size_t> order(keys.size());
+			for (size_t row = 0; row < keys.size(); ++row)
+				order[cursor[partition_of(hashes[row])]++] = row;
+
+			for (size_t p = 0; p < partitions.size(); ++p)
+			{
+				map_type& map = partitions[p];
+				map.reserve(offsets[p + 1] - offsets[p]);
+				for (size_t i = offsets[p]; i < offsets[p + 1]; ++i)
+				{
+					size_t row = order[i];
+					map.insert(std::move(keys[row]), std::move(values[row]), hashes[row]);
+				}
+				map.seal();
+				max_count = std::max(max_count, map.max_equal_count());
+			}
+		}
+
+		size_t choose_partition_bits(size_t rows) const
+		{
+			size_t bytes = rows * (sizeof(TKey) + sizeof(other_value_type) + 4 * sizeof(size_t));
+			if (mode == join_mode::hash || (mode == join_mode::automatic && bytes < join_partition_threshold))
+				return 0;
+
+			size_t bits = 1;
+			while (bits < 12 && (bytes >> bits) > join_partition_bytes)
+				++bits;
+			return bits;
+		}
+
+		TOtherRange				other_range;
+		TOtherKeySelector		other_key_selector;
+		range_size				other_hint;
+		join_mode				mode;
+		std::once_flag			built;
+		std::vector<map_type>	partitions;
+		size_t					partition_shift;
+		size_t					max_count;
+	};
+
+	template<
+		typename TRange,
+		typename TOtherRange,
+		typename TKeySelector,
+		typename TOtherKeySelector,
+		typename TCombiner>
+	class join_range
+	{
+	public:
+
+		typedef typename extract_return_type<TKeySelector,typename TRange::value_type>::type				raw_key_type;
+		typedef typename cleanup_type<raw_key_type>::type													key_type;
+		typedef typename extract_return_type<TOtherKeySelector,typename TOtherRange::value_type>::type		raw_other_key_type;
+		typedef typename cleanup_type<raw_other_key_type>::type												other_key_type;
+		typedef join_table<TOtherRange, TOtherKeySelector, other_key_type>									table_type;
+		typedef typename table_type::map_type																map_type;
+		typedef typename map_type::const_iterator															map_iterator_type;
+		typedef typename extract_return_type_2_args<
+			TCombiner,
+			typename TRange::value_type,
+			typename TOtherRange::value_type>::type															raw_value_type;
+		typedef typename cleanup_type<raw_value_type>::type													value_type;
+		typedef const value_type&																			return_type;
+		typedef std::false_type																				is_random_access;
+		typedef join_range																					slice_type;
+
+
+		join_range(
+			TRange						_range,
+			TOtherRange					_other_range,
+			TKeySelector				_key_selector,
+			TOtherKeySelector			_other_key_selector,
+			TCombiner					_combiner,
+			join_mode					_mode = join_mode::automatic)
+			:key_selector(std::move(_key_selector))
+			,range(std::move(_range))
+			,table(std::make_shared<table_type>(std::move(_other_range), std::move(_other_key_selector), _mode))
+			,combiner(std::move(_combiner))
+			,is_first_visit(true)
+			,cache_iterator(NULL)
+			,cache_end(NULL)
+			,block_pos(0)
+		{
+
+		}
+
+		bool next()
+		{
+			current.reset();
+			if (is_first_visit)
+			{
+				is_first_visit = false;
+				table->build_once();
+			}
+
+			if (table->empty())
+				return false;
+
+			if (cache_iterator != cache_end && ++cache_iterator != cache_end)
+				return true;
+
+			if (table->is_partitioned())
+				return next_partitioned();
+
+			const map_type& cache = table->partition(0);
+			while (range.next())
+			{
+				key_type key = key_selector(range.front());
+				std::pair<map_iterator_type, map_iterator_type> found = cache.equal_range(key);
+				if (found.first != found.second)
+				{
+					cache_iterator = found.first;
+					cache_end = found.second;
+					return true;
+				}
+			}
+
+			cache_iterator = cache_end;
+			return false;
+		}
+
+		//the combiner runs once per match, the reference stays valid until the next call of next()
+		return_type front()
+		{
+			if (!current.engaged())
+				current.emplace(combine());
+			return current.get();
+		}
+
+		//matches are combined straight into buffer instead of through the value front() caches
+		size_t next_batch(const value_type*& values, value_type* buffer, size_t n)
+		{
+			size_t ret = 0;
+			while (ret < n && next())
+			{
+				buffer[ret++] = combine();
+			}
+			values = buffer;
+			return ret;
+		}
+
+		range_size size_hint() const
+		{
+			if (is_first_visit)
+				return range_size::at_most((range.size_hint() * table->size_hint()).count);
+
+			range_size outer = range.size_hint();
+			if (block_pos < block.size())
+				outer = outer + range_size::at_most(block.size() - block_pos - 1);
+			range_size ret = range_size::at_most((outer * range_size::at_most(table->max_equal_count())).count);
+			if (cache_iterator != cache_end)
+				ret = ret + range_size::at_most(static_cast<size_t>(cache_end - cache_iterator) - 1);
+			return ret;
+		}
+
+		size_t split_size() const
+		{
+			return 1;
+		}
+
+		slice_type slice(size_t, size_t) const
+		{
+			return *this;
+		}
+
+	private:
+		value_type combine()
+		{
+			if (table->is_partitioned())
+				return combiner(block[block_pos], *cache_iterator);
+			return combiner(range.front(), *cache_iterator);
+		}
+
+		//outer rows are buffered in blocks and probed partition by partition, matches still come out in outer order
+		bool next_partitioned()
+		{
+			for (;;)
+			{
+				while (++block_pos < block.size())
+				{
+					if (block_matches[block_pos].first != block_matches[block_pos].second)
+					{
+						cache_iterator = block_matches[block_pos].first;
+						cache_end = block_matches[block_pos].second;
+						return true;
+					}
+				}
+
+				if (!fill_block())
+				{
+					cache_iterator = cache_end;
+					return false;
+				}
+				block_pos = size_t(-1);
+			}
+		}
+
+		bool fill_block()
+		{
+			size_t partitions = table->partition_count();
+			size_t block_size = partitions * join_probe_rows_per_partition;
+
+			block.clear();
+			block_keys.clear();
+			block_hashes.clear();
+			std::vector<size_t> offsets(partitions + 1, 0);
+			while (block.size() < block_size && range.next())
+			{
+				block.push_back(range.front());
+				block_keys.push_back(key_selector(block.back()));
+				block_hashes.push_back(table->partition(0).hash(block_keys.back()));
+				++offsets[table->partition_of(block_hashes.back()) + 1];
+			}
+			if (block.empty())
+				return false;
+
+			for (size_t p = 0; p < partitions; ++p)
+				offsets[p + 1] += offsets[p];
+			std::vector<size_t> order(block.size());
+			for (size_t row = 0; row < block.size(); ++row)
+				order[offsets[table->partition_of(block_hashes[row])]++] = row;
+
+			block_matches.resize(block.size());
+			for (size_t i = 0; i < order.size(); ++i)
+			{
+				size_t row = order[i];
+				const map_type& map = table->partition(table->partition_of(block_hashes[row]));
+				block_matches[row] = map.equal_range(block_keys[row], block_hashes[row]);
+			}
+			return true;
+		}
+
+		TKeySelector											key_selector;
+		TRange													range;
+		std::shared_ptr<table_type>								table;
+		TCombiner												combiner;
+		bool													is_first_visit;
+		map_iterator_type										cache_iterator;
+		map_iterator_type										cache_end;
+
+		std::vector<typename TRange::value_type>				block;
+		std::vector<key_type>									block_keys;
+		std::vector<size_t>										block_hashes;
+		std::vector<std::pair<map_iterator_type, map_iterator_type>>	block_matches;
+		size_t													block_pos;
+		cached_value<value_type>								current;
+	};
+
+
+	enum class compare_op
+	{
+		less,
+		less_equal,
+		greater,
+		greater_equal,
+		equal,
+		not_equal,
+	};
+
+	template<compare_op op, typename TValue>
+	bool compare_values(const TValue& lhs, const TValue& rhs)
+	{
+		switch (op)
+		{
+		case compare_op::less:			return lhs < rhs;
+		case compare_op::less_equal:	return lhs <= rhs;
+		case compare_op::greater:		return lhs > rhs;
+		case compare_op::greater_equal:	return lhs >= rhs;
+		case compare_op::equal:			return lhs == rhs;
+		default:						return lhs != rhs;
+		}
+	}
+
+	//arithmetic operands meet in their common type like the built-in operators do, so greater_than(4)
+	//over doubles does not truncate 4.5 to 4; anything else is compared as the constant's type
+	template<typename TElement, typename TValue, bool = std::is_arithmetic<TElement>::value && std::is_arithmetic<TValue>::value>
+	struct compare_type
+	{
+		typedef TValue type;
+	};
+
+	template<typename TElement, typename TValue>
+	struct compare_type<TElement, TValue, true>
+	{
+		typedef typename std::common_type<TElement, TValue>::type type;
+	};
+
+	//predicate comparing elements against a constant; unlike a lambda, count() and to_vector() can see
+	//through it and run vectorized kernels when it filters an array or vector of int, float or double
+	template<typename TValue, compare_op op>
+	struct compare_predicate
+	{
+		template<typename TElement>
+		bool operator()(const TElement& element) const
+		{
+			typedef typename compare_type<TElement, TValue>::type type;
+			return compare_values<op>(static_cast<type>(element), static_cast<type>(value));
+		}
+
+		TValue value;
+	};
+
+	template<typename TValue>
+	compare_predicate<TValue, compare_op::less> less_than(TValue value)
+	{
+		compare_predicate<TValue, compare_op::less> ret = {value};
+		return ret;
+	}
+
+	template<typename TValue>
+	compare_predicate<TValue, compare_op::less_equal> less_or_equal(TValue value)
+	{
+		compare_predicate<TValue, compare_op::less_equal> ret = {value};
+		return ret;
+	}
+
+	template<typename TValue>
+	compare_predicate<TValue, compare_op::greater> greater_than(TValue value)
+	{
+		compare_predicate<TValue, compare_op::greater> ret = {value};
+		return ret;
+	}
+
+	template<typename TValue>
+	compare_predicate<TValue, compare_op::greater_equal> greater_or_equal(TValue value)
+	{
+		compare_predicate<TValue, compare_op::greater_equal> ret = {value};
+		return ret;
+	}
+
+	template<typename TValue>
+	compare_predicate<TValue, compare_op::equal> equals(TValue value)
+	{
+		compare_predicate<TValue, compare_op::equal> ret = {value};
+		return ret;
+	}
+
+	template<typename TValue>
+	compare_predicate<TValue, compare_op::not_equal> not_equals(TValue value)
+	{
+		compare_predicate<TValue, compare_op::not_equal> ret = {value};
+		return ret;
+	}
+
+	template<typename TRange>
+	struct is_contiguous_range : std::false_type
+	{
+	};
+
+	template<typename TIterator>
+	struct is_contiguous_range<basic_range<TIterator>>
+		: std::integral_constant<bool, is_contiguous_iterator<TIterator>::value>
+	{
+	};
+
+	template<typename TContainer, typename TOwnership>
+	struct is_contiguous_range<storage_range<TContainer, TOwnership>>
+		: is_contiguous_range<typename storage_range<TContainer, TOwnership>::slice_type>
+	{
+	};
+
+	template<typename TValue, size_t N>
+	struct is_contiguous_range<inline_range<TValue, N>> : std::true_type
+	{
+	};
+
+	//ranges whose elements belong to the pipeline alone: a uniquely owned container, inline values
+	//or values computed by select and join. a consuming terminal may move them out
+	template<typename TRange>
+	struct owns_elements : std::false_type
+	{
+	};
+
+	template<typename TContainer>
+	struct owns_elements<storage_range<TContainer, unique_storage>> : std::true_type
+	{
+	};
+
+	template<typename TValue, size_t N>
+	struct owns_elements<inline_range<TValue, N>> : std::true_type
+	{
+	};
+
+	template<typename TRange, typename TFunction>
+	struct owns_elements<select_range<TRange, TFunction>> : std::true_type
+	{
+	};
+
+	template<typename TRange, typename TOtherRange, typename TKeySelector, typename TOtherKeySelector, typename TCombiner>
+	struct owns_elements<join_range<TRange, TOtherRange, TKeySelector, TOtherKeySelector, TCombiner>> : std::true_type
+	{
+	};
+
+	template<typename TRange, typename TFunction>
+	struct owns_elements<where_range<TRange, TFunction>> : owns_elements<TRange>
+	{
+	};
+
+	template<typename TRange>
+	struct owns_elements<take_range<TRange>> : owns_elements<TRange>
+	{
+	};
+
+	template<typename TRange>
+	struct owns_elements<skip_range<TRange>> : owns_elements<TRange>
+	{
+	};
+
+	template<typename TRange, typename TKeySelector, typename TThen>
+	struct owns_elements<order_range<TRange, TKeySelector, TThen>> : std::true_type
+	{
+	};
+
+	template<typename TRange, typename TKeySelector>
+	struct owns_elements<distinct_range<TRange, TKeySelector>> : owns_elements<TRange>
+	{
+	};
+
+	//front() hands out the hashed values themselves, which later lookups still compare against
+	template<typename TRange, typename TOtherRange, set_mode mode>
+	struct owns_elements<set_operation_range<TRange, TOtherRange, mode>> : std::false_type
+	{
+	};
+
+	template<typename TRange>
+	struct owns_elements<reverse_range<TRange>> : owns_elements<TRange>
+	{
+	};
+
+	template<typename TRange>
+	struct owns_elements<buffered_reverse_range<TRange>> : std::true_type
+	{
+	};
+
+	template<typename TRange, typename TKeySelector>
+	struct owns_elements<group_range<TRange, TKeySelector>> : std::true_type
+	{
+	};
+
+	template<typename TRange, typename TKeySelector, typename TAccumulate, typename TAccumulateFunction>
+	struct owns_elements<aggregate_by_range<TRange, TKeySelector, TAccumulate, TAccumulateFunction>> : std::true_type
+	{
+	};
+
+	template<typename TRange, typename TKeySelector>
+	struct owns_elements<group_adjacent_range<TRange, TKeySelector>> : std::true_type
+	{
+	};
+
+	template<typename TRange, typename TKeySelector, typename TAccumulate, typename TAccumulateFunction>
+	struct owns_elements<aggregate_adjacent_range<TRange, TKeySelector, TAccumulate, TAccumulateFunction>> : std::true_type
+	{
+	};
+
+	template<typename TRange>
+	struct owns_elements<distinct_until_changed_range<TRange>> : owns_elements<TRange>
+	{
+	};
+
+	template<typename TRange, typename TOtherRange>
+	struct owns_elements<concat_range<TRange, TOtherRange>> : std::integral_constant<bool,
+		owns_elements<TRange>::value &&
+		owns_elements<TOtherRange>::value>
+	{
+	};
+
+	//owns_elements for this copy of the range: a uniquely owned container is only borrowed by copies,
+	//whose elements still belong to the range they were copied from
+	template<typename TRange>
+	bool elements_owned(const TRange&)
+	{
+		return owns_elements<TRange>::value;
+	}
+
+	template<typename TContainer>
+	bool elements_owned(const storage_range<TContainer, unique_storage>& range)
+	{
+		return range.owns_container();
+	}
+
+	template<typename TRange, typename TFunction>
+	bool elements_owned(const where_range<TRange, TFunction>& range)
+	{
+		return elements_owned(range.source_range());
+	}
+
+	template<typename TRange>
+	bool elements_owned(const take_range<TRange>& range)
+	{
+		return elements_owned(range.source_range());
+	}
+
+	template<typename TRange>
+	bool elements_owned(const skip_range<TRange>& range)
+	{
+		return elements_owned(range.source_range());
+	}
+
+	template<typename TRange, typename TKeySelector>
+	bool elements_owned(const distinct_range<TRange, TKeySelector>& range)
+	{
+		return elements_owned(range.source_range());
+	}
+
+	template<typename TRange>
+	bool elements_owned(const reverse_range<TRange>& range)
+	{
+		return elements_owned(range.source_range());
+	}
+
+	template<typename TRange>
+	bool elements_owned(const distinct_until_changed_range<TRange>& range)
+	{
+		return elements_owned(range.source_range());
+	}
+
+	template<typename TRange, typename TOtherRange>
+	bool elements_owned(const concat_range<TRange, TOtherRange>& range)
+	{
+		return elements_owned(range.source_range()) && elements_owned(range.appended_range());
+	}
+
+	//ranges whose front() refers to an element that stays at the same address for as long as the
+	//source itself, whichever copy of the range reads it: forward iterators over external data,
+	//or containers shared between copies
+	template<typename TRange>
+	struct has_stable_elements : std::false_type
+	{
+	};
+
+	template<typename TIterator>
+	struct has_stable_elements<basic_range<TIterator>> : std::integral_constant<bool,
+		std::is_base_of<std::forward_iterator_tag, typename basic_range<TIterator>::iterator_category>::value &&
+		std::is_reference<typename basic_range<TIterator>::raw_value_type>::value>
+	{
+	};
+
+	template<typename TContainer>
+	struct has_stable_elements<storage_range<TContainer, shared_storage>>
+		: has_stable_elements<typename storage_range<TContainer, shared_storage>::slice_type>
+	{
+	};
+
+	template<typename TContainer>
+	struct has_stable_elements<storage_range<TContainer, local_storage>>
+		: has_stable_elements<typename storage_range<TContainer, local_storage>::slice_type>
+	{
+	};
+
+	template<typename TRange, typename TFunction>
+	struct has_stable_elements<where_range<TRange, TFunction>> : has_stable_elements<TRange>
+	{
+	};
+
+	template<typename TRange>
+	struct has_stable_elements<take_range<TRange>> : has_stable_elements<TRange>
+	{
+	};
+
+	template<typename TRange>
+	struct has_stable_elements<skip_range<TRange>> : has_stable_elements<TRange>
+	{
+	};
+
+	template<typename TRange, typename TKeySelector>
+	struct has_stable_elements<distinct_range<TRange, TKeySelector>> : has_stable_elements<TRange>
+	{
+	};
+
+	template<typename TRange, typename TOtherRange>
+	struct has_stable_elements<concat_range<TRange, TOtherRange>> : std::integral_constant<bool,
+		has_stable_elements<TRange>::value &&
+		has_stable_elements<TOtherRange>::value>
+	{
+	};
+
+	template<typename TRange>
+	struct has_stable_elements<reverse_range<TRange>> : has_stable_elements<TRange>
+	{
+	};
+
+	//ranges whose front() refers to an element that stays put while the range lives: forward iterators over
+	//external data, containers and values held by the source. select, join and the grouping stages hand
+	//out a slot they overwrite on the next call of next(), so ref() over them does not compile
+	template<typename TRange>
+	struct has_element_references : std::false_type
+	{
+	};
+
+	template<typename TIterator>
+	struct has_element_references<basic_range<TIterator>> : has_stable_elements<basic_range<TIterator>>
+	{
+	};
+
+	template<typename TContainer, typename TOwnership>
+	struct has_element_references<storage_range<TContainer, TOwnership>>
+		: has_element_references<typename storage_range<TContainer, TOwnership>::slice_type>
+	{
+	};
+
+	template<typename TValue, size_t N>
+	struct has_element_references<inline_range<TValue, N>> : std::true_type
+	{
+	};
+
+	template<typename TRange, typename TFunction>
+	struct has_element_references<where_range<TRange, TFunction>> : has_element_references<TRange>
+	{
+	};
+
+	template<typename TRange>
+	struct has_element_references<take_range<TRange>> : has_element_references<TRange>
+	{
+	};
+
+	template<typename TRange>
+	struct has_element_references<skip_range<TRange>> : has_element_references<TRange>
+	{
+	};
+
+	template<typename TRange, typename TKeySelector>
+	struct has_element_references<distinct_range<TRange, TKeySelector>> : has_element_references<TRange>
+	{
+	};
+
+	template<typename TRange, typename TOtherRange>
+	struct has_element_references<concat_range<TRange, TOtherRange>> : std::integral_constant<bool,
+		has_element_references<TRange>::value &&
+		has_element_references<TOtherRange>::value>
+	{
+	};
+
+	template<typename TRange>
+	struct has_element_references<reverse_range<TRange>> : has_element_references<TRange>
+	{
+	};
+
+	template<typename TRange>
+	struct has_element_references<distinct_until_changed_range<TRange>> : has_element_references<TRange>
+	{
+	};
+
+	//ranges with next_back()/back(), walking from the end: bidirectional iterators, through select and ref
+	template<typename TRange>
+	struct is_reversible : std::false_type
+	{
+	};
+
+	template<typename TIterator>
+	struct is_reversible<basic_range<TIterator>> : std::integral_constant<bool,
+		std::is_base_of<std::bidirectional_iterator_tag, typename basic_range<TIterator>::iterator_category>::value &&
+		std::is_reference<typename basic_range<TIterator>::raw_value_type>::value>
+	{
+	};
+
+	template<typename TContainer, typename TOwnership>
+	struct is_reversible<storage_range<TContainer, TOwnership>>
+		: is_reversible<typename storage_range<TContainer, TOwnership>::slice_type>
+	{
+	};
+
+	template<typename TValue, size_t N>
+	struct is_reversible<inline_range<TValue, N>> : std::true_type
+	{
+	};
+
+	template<typename TRange, typename TFunction>
+	struct is_reversible<select_range<TRange, TFunction>> : is_reversible<TRange>
+	{
+	};
+
+	template<typename TRange>
+	struct is_reversible<ref_range<TRange>> : is_reversible<TRange>
+	{
+	};
+
+	template<typename TRange>
+	struct reversed_range
+	{
+		typedef typename std::conditional<
+			is_reversible<TRange>::value,
+			reverse_range<TRange>,
+			buffered_reverse_range<TRange>>::type type;
+	};
+
+	template<typename TValue>
+	struct is_simd_value : std::integral_constant<bool,
+		std::is_same<TValue, int>::value ||
+		std::is_same<TValue, float>::value ||
+		std::is_same<TValue, double>::value>
+	{
+	};
+
+	//contiguous ranges of int, float or double, which the vectorized kernels read through data()
+	template<typename TRange>
+	struct is_simd_range : std::integral_constant<bool,
+		is_contiguous_range<TRange>::value &&
+		is_simd_value<typename TRange::value_type>::value>
+	{
+	};
+
+	inline size_t bit_count(unsigned int mask)
+	{
+		mask = mask - ((mask >> 1) & 0x55555555u);
+		mask = (mask & 0x33333333u) + ((mask >> 2) & 0x33333333u);
+		return (((mask + (mask >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24;
+	}
+
+	enum class simd_level
+	{
+		scalar,
+		sse2,
+		avx2,
+		avx512,
+	};
+
+	//widest instruction set both the compiler and the running CPU (and OS) support
+	inline simd_level detect_simd_level()
+	{
+#if defined(TINYLINQ_SIMD_X86) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		int max_leaf = info[0];
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+		bool avx2 = false;
+		bool avx512 = false;
+		if (max_leaf >= 7)
+		{
+			__cpuidex(info, 7, 0);
+			avx2 = (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+			avx512 = (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;
+		}
+#if defined(TINYLINQ_SIMD_AVX512)
+		if (avx512)
+			return simd_level::avx512;
+#endif
+		return avx2 ? simd_level::avx2 : simd_level::sse2;
+#elif defined(TINYLINQ_SIMD_X86)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return simd_level::avx512;
+		if (__builtin_cpu_supports("avx2"))
+			return simd_level::avx2;
+		return simd_level::sse2;
+#else
+		return simd_level::scalar;
+#endif
+	}
+
+	inline std::atomic<simd_level>& simd_level_storage()
+	{
+		static std::atomic<simd_level> level(detect_simd_level());
+		return level;
+	}
+
+	inline simd_level get_simd_level()
+	{
+		return simd_level_storage().load(std::memory_order_relaxed);
+	}
+
+	//cap the instruction set the kernels use, for comparing kernels or working around a platform issue
+	inline void set_simd_level(simd_level level)
+	{
+		simd_level_storage().store(std::min(level, detect_simd_level()));
+	}
+
+	//per instruction set vector operations, specialized for int, float and double
+	template<typename TValue>
+	struct simd_scalar
+	{
+		typedef TValue	vector;
+		static const size_t width = 1;
+
+		static vector load(const TValue* data)					{ return *data; }
+		static void store(TValue* out, vector v)				{ *out = v; }
+		static vector set1(TValue value)						{ return value; }
+		static vector zero()									{ return TValue(); }
+		static vector add(vector a, vector b)					{ return a + b; }
+		static vector minimum(vector a, vector b)				{ return b < a ? b : a; }
+		static vector maximum(vector a, vector b)				{ return a < b ? b : a; }
+
+		template<compare_op op>
+		static unsigned int compare(vector a, vector b)
+		{
+			return compare_values<op>(a, b) ? 1u : 0u;
+		}
+
+		static size_t compress_store(TValue* out, unsigned int mask, vector v)
+		{
+			*out = v;
+			return mask & 1u;
+		}
+	};
+
+#if defined(TINYLINQ_SIMD_X86)
+	//lanes selected by mask written to out, back to back; also the way to do it without AVX-512
+	template<typename TValue, size_t width>
+	size_t compress_lanes(TValue* out, unsigned int mask, const TValue* lanes)
+	{
+		size_t k = 0;
+		for (size_t j = 0; j < width; ++j)
+		{
+			out[k] = lanes[j];
+			k += (mask >> j) & 1u;
+		}
+		return k;
+	}
+
+	template<typename TValue>
+	struct simd_sse2;
+
+	template<>
+	struct simd_sse2<int>
+	{
+		typedef __m128i	vector;
+		static const size_t width = 4;
+
+		TINYLINQ_TARGET_SSE2 static vector load(const int* data)				{ return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)); }
+		TINYLINQ_TARGET_SSE2 static void store(int* out, vector v)				{ _mm_storeu_si128(reinterpret_cast<__m128i*>(out), v); }
+		TINYLINQ_TARGET_SSE2 static vector set1(int value)						{ return _mm_set1_epi32(value); }
+		TINYLINQ_TARGET_SSE2 static vector zero()								{ return _mm_setzero_si128(); }
+		TINYLINQ_TARGET_SSE2 static vector add(vector a, vector b)				{ return _mm_add_epi32(a, b); }
+		TINYLINQ_TARGET_SSE2 static vector minimum(vector a, vector b)
+		{
+			__m128i greater = _mm_cmpgt_epi32(a, b);
+			return _mm_or_si128(_mm_and_si128(greater, b), _mm_andnot_si128(greater, a));
+		}
+		TINYLINQ_TARGET_SSE2 static vector maximum(vector a, vector b)
+		{
+			__m128i greater = _mm_cmpgt_epi32(a, b);
+			return _mm_or_si128(_mm_and_si128(greater, a), _mm_andnot_si128(greater, b));
+		}
+
+		template<compare_op op>
+		TINYLINQ_TARGET_SSE2 static unsigned int compare(vector a, vector b)
+		{
+			switch (op)
+			{
+			case compare_op::less:			return mask(_mm_cmplt_epi32(a, b));
+			case compare_op::less_equal:	return mask(_mm_cmpgt_epi32(a, b)) ^ 0xfu;
+			case compare_op::greater:		return mask(_mm_cmpgt_epi32(a, b));
+			case compare_op::greater_equal:	return mask(_mm_cmplt_epi32(a, b)) ^ 0xfu;
+			case compare_op::equal:			return mask(_mm_cmpeq_epi32(a, b));
+			default:						return mask(_mm_cmpeq_epi32(a, b)) ^ 0xfu;
+			}
+		}
+
+		TINYLINQ_TARGET_SSE2 static size_t compress_store(int* out, unsigned int mask, vector v)
+		{
+			int lanes[width];
+			store(lanes, v);
+			return compress_lanes<int, width>(out, mask, lanes);
+		}
+
+		TINYLINQ_TARGET_SSE2 static unsigned int mask(vector v)
+		{
+			return static_cast<unsigned int>(_mm_movemask_ps(_mm_castsi128_ps(v)));
+		}
+	};
+
+	template<>
+	struct simd_sse2<float>
+	{
+		typedef __m128	vector;
+		static const size_t width = 4;
+
+		TINYLINQ_TARGET_SSE2 static vector load(const float* data)				{ return _mm_loadu_ps(data); }
+		TINYLINQ_TARGET_SSE2 static void store(float* out, vector v)			{ _mm_storeu_ps(out, v); }
+		TINYLINQ_TARGET_SSE2 static vector set1(float value)					{ return _mm_set1_ps(value); }
+		TINYLINQ_TARGET_SSE2 static vector zero()								{ return _mm_setzero_ps(); }
+		TINYLINQ_TARGET_SSE2 static vector add(vector a, vector b)				{ return _mm_add_ps(a, b); }
+		TINYLINQ_TARGET_SSE2 static vector minimum(vector a, vector b)			{ return _mm_min_ps(b, a); }
+		TINYLINQ_TARGET_SSE2 static vector maximum(vector a, vector b)			{ return _mm_max_ps(b, a); }
+
+		template<compare_op op>
+		TINYLINQ_TARGET_SSE2 static unsigned int compare(vector a, vector b)
+		{
+			switch (op)
+			{
+			case compare_op::less:			return _mm_movemask_ps(_mm_cmplt_ps(a, b));
+			case compare_op::less_equal:	return _mm_movemask_ps(_mm_cmple_ps(a, b));
+			case compare_op::greater:		return _mm_movemask_ps(_mm_cmpgt_ps(a, b));
+			case compare_op::greater_equal:	return _mm_movemask_ps(_mm_cmpge_ps(a, b));
+			case compare_op::equal:			return _mm_movemask_ps(_mm_cmpeq_ps(a, b));
+			default:						return _mm_movemask_ps(_mm_cmpneq_ps(a, b));
+			}
+		}
+
+		TINYLINQ_TARGET_SSE2 static size_t compress_store(float* out, unsigned int mask, vector v)
+		{
+			float lanes[width];
+			store(lanes, v);
+			return compress_lanes<float, width>(out, mask, lanes);
+		}
+	};
+
+	template<>
+	struct simd_sse2<double>
+	{
+		typedef __m128d	vector;
+		static const size_t width = 2;
+
+		TINYLINQ_TARGET_SSE2 static vector load(const double* data)				{ return _mm_loadu_pd(data); }
+		TINYLINQ_TARGET_SSE2 static void store(double* out, vector v)			{ _mm_storeu_pd(out, v); }
+		TINYLINQ_TARGET_SSE2 static vector set1(double value)					{ return _mm_set1_pd(value); }
+		TINYLINQ_TARGET_SSE2 static vector zero()								{ return _mm_setzero_pd(); }
+		TINYLINQ_TARGET_SSE2 static vector add(vector a, vector b)				{ return _mm_add_pd(a, b); }
+		TINYLINQ_TARGET_SSE2 static vector minimum(vector a, vector b)			{ return _mm_min_pd(b, a); }
+		TINYLINQ_TARGET_SSE2 static vector maximum(vector a, vector b)			{ return _mm_max_pd(b, a); }
+
+		template<compare_op op>
+		TINYLINQ_TARGET_SSE2 static unsigned int compare(vector a, vector b)
+		{
+			switch (op)
+			{
+			case compare_op::less:			return _mm_movemask_pd(_mm_cmplt_pd(a, b));
+			case compare_op::less_equal:	return _mm_movemask_pd(_mm_cmple_pd(a, b));
+			case compare_op::greater:		return _mm_movemask_pd(_mm_cmpgt_pd(a, b));
+			case compare_op::greater_equal:	return _mm_movemask_pd(_mm_cmpge_pd(a, b));
+			case compare_op::equal:			return _mm_movemask_pd(_mm_cmpeq_pd(a, b));
+			default:						return _mm_movemask_pd(_mm_cmpneq_pd(a, b));
+			}
+		}
+
+		TINYLINQ_TARGET_SSE2 static size_t compress_store(double* out, unsigned int mask, vector v)
+		{
+			double lanes[width];
+			store(lanes, v);
+			return compress_lanes<double, width>(out, mask, lanes);
+		}
+	};
+
+	template<typename TValue>
+	struct simd_avx2;
+
+	template<>
+	struct simd_avx2<int>
+	{
+		typedef __m256i	vector;
+		static const size_t width = 8;
+
+		TINYLINQ_TARGET_AVX2 static vector load(const int* data)				{ return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data)); }
+		TINYLINQ_TARGET_AVX2 static void store(int* out, vector v)				{ _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), v); }
+		TINYLINQ_TARGET_AVX2 static vector set1(int value)						{ return _mm256_set1_epi32(value); }
+		TINYLINQ_TARGET_AVX2 static vector zero()								{ return _mm256_setzero_si256(); }
+		TINYLINQ_TARGET_AVX2 static vector add(vector a, vector b)				{ return _mm256_add_epi32(a, b); }
+		TINYLINQ_TARGET_AVX2 static vector minimum(vector a, vector b)			{ return _mm256_min_epi32(a, b); }
+		TINYLINQ_TARGET_AVX2 static vector maximum(vector a, vector b)			{ return _mm256_max_epi32(a, b); }
+
+		template<compare_op op>
+		TINYLINQ_TARGET_AVX2 static unsigned int compare(vector a, vector b)
+		{
+			switch (op)
+			{
+			case compare_op::less:			return mask(_mm256_cmpgt_epi32(b, a));
+			case compare_op::less_equal:	return mask(_mm256_cmpgt_epi32(a, b)) ^ 0xffu;
+			case compare_op::greater:		return mask(_mm256_cmpgt_epi32(a, b));
+			case compare_op::greater_equal:	return mask(_mm256_cmpgt_epi32(b, a)) ^ 0xffu;
+			case compare_op::equal:			return mask(_mm256_cmpeq_epi32(a, b));
+			default:						return mask(_mm256_cmpeq_epi32(a, b)) ^ 0xffu;
+			}
+		}
+
+		TINYLINQ_TARGET_AVX2 static size_t compress_store(int* out, unsigned int mask, vector v)
+		{
+			int lanes[width];
+			store(lanes, v);
+			return compress_lanes<int, width>(out, mask, lanes);
+		}
+
+		TINYLINQ_TARGET_AVX2 static unsigned int mask(vector v)
+		{
+			return static_cast<unsigned int>(_mm256_movemask_ps(_mm256_castsi256_ps(v)));
+		}
+	};
+
+	template<>
+	struct simd_avx2<float>
+	{
+		typedef __m256	vector;
+		static const size_t width = 8;
+
+		TINYLINQ_TARGET_AVX2 static vector load(const float* data)				{ return _mm256_loadu_ps(data); }
+		TINYLINQ_TARGET_AVX2 static void store(float* out, vector v)			{ _mm256_storeu_ps(out, v); }
+		TINYLINQ_TARGET_AVX2 static vector set1(float value)					{ return _mm256_set1_ps(value); }
+		TINYLINQ_TARGET_AVX2 static vector zero()								{ return _mm256_setzero_ps(); }
+		TINYLINQ_TARGET_AVX2 static vector add(vector a, vector b)				{ return _mm256_add_ps(a, b); }
+		TINYLINQ_TARGET_AVX2 static vector minimum(vector a, vector b)			{ return _mm256_min_ps(b, a); }
+		TINYLINQ_TARGET_AVX2 static vector maximum(vector a, vector b)			{ return _mm256_max_ps(b, a); }
+
+		template<compare_op op>
+		TINYLINQ_TARGET_AVX2 static unsigned int compare(vector a, vector b)
+		{
+			switch (op)
+			{
+			case compare_op::less:			return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ));
+			case compare_op::less_equal:	return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ));
+			case compare_op::greater:		return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ));
+			case compare_op::greater_equal:	return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GE_OQ));
+			case compare_op::equal:			return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_EQ_OQ));
+			default:						return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_NEQ_UQ));
+			}
+		}
+
+		TINYLINQ_TARGET_AVX2 static size_t compress_store(float* out, unsigned int mask, vector v)
+		{
+			float lanes[width];
+			store(lanes, v);
+			return compress_lanes<float, width>(out, mask, lanes);
+		}
+	};
+
+	template<>
+	struct simd_avx2<double>
+	{
+		typedef __m256d	vector;
+		static const size_t width = 4;
+
+		TINYLINQ_TARGET_AVX2 static vector load(const double* data)				{ return _mm256_loadu_pd(data); }
+		TINYLINQ_TARGET_AVX2 static void store(double* out, vector v)			{ _mm256_storeu_pd(out, v); }
+		TINYLINQ_TARGET_AVX2 static vector set1(double value)					{ return _mm256_set1_pd(value); }
+		TINYLINQ_TARGET_AVX2 static vector zero()								{ return _mm256_setzero_pd(); }
+		TINYLINQ_TARGET_AVX2 static vector add(vector a, vector b)				{ return _mm256_add_pd(a, b); }
+		TINYLINQ_TARGET_AVX2 static vector minimum(vector a, vector b)			{ return _mm256_min_pd(b, a); }
+		TINYLINQ_TARGET_AVX2 static vector maximum(vector a, vector b)			{ return _mm256_max_pd(b, a); }
+
+		template<compare_op op>
+		TINYLINQ_TARGET_AVX2 static unsigned int compare(vector a, vector b)
+		{
+			switch (op)
+			{
+			case compare_op::less:			return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ));
+			case compare_op::less_equal:	return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ));
+			case compare_op::greater:		return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GT_OQ));
+			case compare_op::greater_equal:	return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GE_OQ));
+			case compare_op::equal:			return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ));
+			default:						return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_NEQ_UQ));
+			}
+		}
+
+		TINYLINQ_TARGET_AVX2 static size_t compress_store(double* out, unsigned int mask, vector v)
+		{
+			double lanes[width];
+			store(lanes, v);
+			return compress_lanes<double, width>(out, mask, lanes);
+		}
+	};
+
+#if defined(TINYLINQ_SIMD_AVX512)
+	template<typename TValue>
+	struct simd_avx512;
+
+	//min/max go through the zero-masked forms: the plain ones pass an undefined vector as the unused
+	//merge source, which gcc reports as maybe-uninitialized once the kernels are inlined
+	template<>
+	struct simd_avx512<int>
+	{
+		typedef __m512i	vector;
+		static const size_t width = 16;
+
+		TINYLINQ_TARGET_AVX512 static vector load(const int* data)				{ return _mm512_loadu_si512(data); }
+		TINYLINQ_TARGET_AVX512 static void store(int* out, vector v)			{ _mm512_storeu_si512(out, v); }
+		TINYLINQ_TARGET_AVX512 static vector set1(int value)					{ return _mm512_set1_epi32(value); }
+		TINYLINQ_TARGET_AVX512 static vector zero()								{ return _mm512_setzero_si512(); }
+		TINYLINQ_TARGET_AVX512 static vector add(vector a, vector b)			{ return _mm512_add_epi32(a, b); }
+		TINYLINQ_TARGET_AVX512 static vector minimum(vector a, vector b)		{ return _mm512_maskz_min_epi32(0xffff, a, b); }
+		TINYLINQ_TARGET_AVX512 static vector maximum(vector a, vector b)		{ return _mm512_maskz_max_epi32(0xffff, a, b); }
+
+		template<compare_op op>
+		TINYLINQ_TARGET_AVX512 static unsigned int compare(vector a, vector b)
+		{
+			switch (op)
+			{
+			case compare_op::less:			return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_LT);
+			case compare_op::less_equal:	return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_LE);
+			case compare_op::greater:		return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_NLE);
+			case compare_op::greater_equal:	return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_NLT);
+			case compare_op::equal:			return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_EQ);
+			default:						return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_NE);
+			}
+		}
+
+		TINYLINQ_TARGET_AVX512 static size_t compress_store(int* out, unsigned int mask, vector v)
+		{
+			_mm512_mask_compressstoreu_epi32(out, static_cast<__mmask16>(mask), v);
+			return bit_count(mask);
+		}
+	};
+
+	template<>
+	struct simd_avx512<float>
+	{
+		typedef __m512	vector;
+		static const size_t width = 16;
+
+		TINYLINQ_TARGET_AVX512 static vector load(const float* data)			{ return _mm512_loadu_ps(data); }
+		TINYLINQ_TARGET_AVX512 static void store(float* out, vector v)			{ _mm512_storeu_ps(out, v); }
+		TINYLINQ_TARGET_AVX512 static vector set1(float value)					{ return _mm512_set1_ps(value); }
+		TINYLINQ_TARGET_AVX512 static vector zero()								{ return _mm512_setzero_ps(); }
+		TINYLINQ_TARGET_AVX512 static vector add(vector a, vector b)			{ return _mm512_add_ps(a, b); }
+		TINYLINQ_TARGET_AVX512 static vector minimum(vector a, vector b)		{ return _mm512_maskz_min_ps(0xffff, b, a); }
+		TINYLINQ_TARGET_AVX512 static vector maximum(vector a, vector b)		{ return _mm512_maskz_max_ps(0xffff, b, a); }
+
+		template<compare_op op>
+		TINYLINQ_TARGET_AVX512 static unsigned int compare(vector a, vector b)
+		{
+			switch (op)
+			{
+			case compare_op::less:			return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);
+			case compare_op::less_equal:	return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ);
+			case compare_op::greater:		return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ);
+			case compare_op::greater_equal:	return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ);
+			case compare_op::equal:			return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ);
+			default:						return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ);
+			}
+		}
+
+		TINYLINQ_TARGET_AVX512 static size_t compress_store(float* out, unsigned int mask, vector v)
+		{
+			_mm512_mask_compressstoreu_ps(out, static_cast<__mmask16>(mask), v);
+			return bit_count(mask);
+		}
+	};
+
+	template<>
+	struct simd_avx512<double>
+	{
+		typedef __m512d	vector;
+		static const size_t width = 8;
+
+		TINYLINQ_TARGET_AVX512 static vector load(const double* data)			{ return _mm512_loadu_pd(data); }
+		TINYLINQ_TARGET_AVX512 static void store(double* out, vector v)			{ _mm512_storeu_pd(out, v); }
+		TINYLINQ_TARGET_AVX512 static vector set1(double value)					{ return _mm512_set1_pd(value); }
+		TINYLINQ_TARGET_AVX512 static vector zero()								{ return _mm512_setzero_pd(); }
+		TINYLINQ_TARGET_AVX512 static vector add(vector a, vector b)			{ return _mm512_add_pd(a, b); }
+		TINYLINQ_TARGET_AVX512 static vector minimum(vector a, vector b)		{ return _mm512_maskz_min_pd(0xff, b, a); }
+		TINYLINQ_TARGET_AVX512 static vector maximum(vector a, vector b)		{ return _mm512_maskz_max_pd(0xff, b, a); }
+
+		template<compare_op op>
+		TINYLINQ_TARGET_AVX512 static unsigned int compare(vector a, vector b)
+		{
+			switch (op)
+			{
+			case compare_op::less:			return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ);
+			case compare_op::less_equal:	return _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ);
+			case compare_op::greater:		return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ);
+			case compare_op::greater_equal:	return _mm512_cmp_pd_mask(a, b, _CMP_GE_OQ);
+			case compare_op::equal:			return _mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ);
+			default:						return _mm512_cmp_pd_mask(a, b, _CMP_NEQ_UQ);
+			}
+		}
+
+		TINYLINQ_TARGET_AVX512 static size_t compress_store(double* out, unsigned int mask, vector v)
+		{
+			_mm512_mask_compressstoreu_pd(out, static_cast<__mmask8>(mask), v);
+			return bit_count(mask);
+		}
+	};
+#endif
+#endif
+
+	//kernel bodies shared by every instruction set: TRAITS supplies the vector operations and TARGET
+	//lets the compiler emit that set inside the kernels (GCC and Clang need it, MSVC does not)
+#define TINYLINQ_SIMD_KERNELS(NAME, TRAITS, TARGET)														\
+	struct NAME																							\
+	{																									\
+		template<typename TValue>																		\
+		TARGET static TValue sum(const TValue* data, size_t n)											\
+		{																								\
+			typedef TRAITS<TValue> traits;																\
+			typename traits::vector first = traits::zero();												\
+			typename traits::vector second = traits::zero();											\
+			size_t i = 0;																				\
+			for (; i + 2 * traits::width <= n; i += 2 * traits::width)									\
+			{																							\
+				first = traits::add(first, traits::load(data + i));										\
+				second = traits::add(second, traits::load(data + i + traits::width));					\
+			}																							\
+			TValue lanes[traits::width];																\
+			traits::store(lanes, traits::add(first, second));											\
+			TValue ret = TValue();																		\
+			for (size_t j = 0; j < traits::width; ++j)													\
+				ret += lanes[j];																		\
+			for (; i < n; ++i)																			\
+				ret += data[i];																			\
+			return ret;																					\
+		}																								\
+																										\
+		template<typename TValue>																		\
+		TARGET static TValue minimum(const TValue* data, size_t n)										\
+		{																								\
+			typedef TRAITS<TValue> traits;																\
+			TValue ret = data[0];																		\
+			size_t i = 0;																				\
+			if (n >= traits::width)																		\
+			{																							\
+				typename traits::vector acc = traits::load(data);										\
+				for (i = traits::width; i + traits::width <= n; i += traits::width)						\
+					acc = traits::minimum(acc, traits::load(data + i));									\
+				TValue lanes[traits::width];															\
+				traits::store(lanes, acc);																\
+				for (size_t j = 0; j < traits::width; ++j)												\
+					ret = lanes[j] < ret ? lanes[j] : ret;												\
+			}																							\
+			for (; i < n; ++i)																			\
+				ret = data[i] < ret ? data[i] : ret;													\
+			return ret;																					\
+		}																								\
+																										\
+		template<typename TValue>																		\
+		TARGET static TValue maximum(const TValue* data, size_t n)										\
+		{																								\
+			typedef TRAITS<TValue> traits;																\
+			TValue ret = data[0];																		\
+			size_t i = 0;																				\
+			if (n >= traits::width)																		\
+			{																							\
+				typename traits::vector acc = traits::load(data);										\
+				for (i = traits::width; i + traits::width <= n; i += traits::width)						\
+					acc = traits::maximum(acc, traits::load(data + i));									\
+				TValue lanes[traits::width];															\
+				traits::store(lanes, acc);																\
+				for (size_t j = 0; j < traits::width; ++j)												\
+					ret = ret < lanes[j] ? lanes[j] : ret;												\
+			}																							\
+			for (; i < n; ++i)																			\
+				ret = ret < data[i] ? data[i] : ret;													\
+			return ret;																					\
+		}																								\
+																										\
+		template<compare_op op, typename TValue>														\
+		TARGET static size_t count(const TValue* data, size_t n, TValue value)							\
+		{																								\
+			typedef TRAITS<TValue> traits;																\
+			typename traits::vector operand = traits::set1(value);										\
+			size_t ret = 0;																				\
+			size_t i = 0;																				\
+			for (; i + traits::width <= n; i += traits::width)											\
+				ret += bit_count(traits::template compare<op>(traits::load(data + i), operand));		\
+			for (const TValue* rest = data + i; rest != data + n; ++rest)								\
+				ret += compare_values<op>(*rest, value) ? 1 : 0;										\
+			return ret;																					\
+		}																								\
+																										\
+		/*out needs room for n elements, the number written is returned*/								\
+		template<compare_op op, typename TValue>														\
+		TARGET static size_t compact(const TValue* data, size_t n, TValue value, TValue* out)			\
+		{																								\
+			typedef TRAITS<TValue> traits;																\
+			typename traits::vector operand = traits::set1(value);										\
+			size_t ret = 0;																				\
+			size_t i = 0;																				\
+			for (; i + traits::width <= n; i += traits::width)											\
+			{																							\
+				typename traits::vector v = traits::load(data + i);										\
+				ret += traits::compress_store(out + ret, traits::template compare<op>(v, operand), v);	\
+			}																							\
+			for (; i < n; ++i)																			\
+			{																							\
+				out[ret] = data[i];																		\
+				ret += compare_values<op>(data[i], value) ? 1 : 0;										\
+			}																							\
+			return ret;																					\
+		}																								\
+	};
+
+	TINYLINQ_SIMD_KERNELS(simd_kernels_scalar, simd_scalar, )
+#if defined(TINYLINQ_SIMD_X86)
+	TINYLINQ_SIMD_KERNELS(simd_kernels_sse2, simd_sse2, TINYLINQ_TARGET_SSE2)
+	TINYLINQ_SIMD_KERNELS(simd_kernels_avx2, simd_avx2, TINYLINQ_TARGET_AVX2)
+#endif
+#if defined(TINYLINQ_SIMD_AVX512)
+	TINYLINQ_SIMD_KERNELS(simd_kernels_avx512, simd_avx512, TINYLINQ_TARGET_AVX512)
+#endif
+
+	template<typename TValue>
+	TValue simd_sum(const TValue* data, size_t n)
+	{
+		switch (get_simd_level())
+		{
+#if defined(TINYLINQ_SIMD_AVX512)
+		case simd_level::avx512:	return simd_kernels_avx512::sum(data, n);
+#endif
+#if defined(TINYLINQ_SIMD_X86)
+		case simd_level::avx2:		return simd_kernels_avx2::sum(data, n);
+		case simd_level::sse2:		return simd_kernels_sse2::sum(data, n);
+#endif
+		default:					return simd_kernels_scalar::sum(data, n);
+		}
+	}
+
+	template<typename TValue>
+	TValue simd_minimum(const TValue* data, size_t n)
+	{
+		switch (get_simd_level())
+		{
+#if defined(TINYLINQ_SIMD_AVX512)
+		case simd_level::avx512:	return simd_kernels_avx512::minimum(data, n);
+#endif
+#if defined(TINYLINQ_SIMD_X86)
+		case simd_level::avx2:		return simd_kernels_avx2::minimum(data, n);
+		case simd_level::sse2:		return simd_kernels_sse2::minimum(data, n);
+#endif
+		default:					return simd_kernels_scalar::minimum(data, n);
+		}
+	}
+
+	template<typename TValue>
+	TValue simd_maximum(const TValue* data, size_t n)
+	{
+		switch (get_simd_level())
+		{
+#if defined(TINYLINQ_SIMD_AVX512)
+		case simd_level::avx512:	return simd_kernels_avx512::maximum(data, n);
+#endif
+#if defined(TINYLINQ_SIMD_X86)
+		case simd_level::avx2:		return simd_kernels_avx2::maximum(data, n);
+		case simd_level::sse2:		return simd_kernels_sse2::maximum(data, n);
+#endif
+		default:					return simd_kernels_scalar::maximum(data, n);
+		}
+	}
+
+	template<compare_op op, typename TValue>
+	size_t simd_count(const TValue* data, size_t n, TValue value)
+	{
+		switch (get_simd_level())
+		{
+#if defined(TINYLINQ_SIMD_AVX512)
+		case simd_level::avx512:	return simd_kernels_avx512::count<op>(data, n, value);
+#endif
+#if defined(TINYLINQ_SIMD_X86)
+		case simd_level::avx2:		return simd_kernels_avx2::count<op>(data, n, value);
+		case simd_level::sse2:		return simd_kernels_sse2::count<op>(data, n, value);
+#endif
+		default:					return simd_kernels_scalar::count<op>(data, n, value);
+		}
+	}
+
+	template<compare_op op, typename TValue>
+	size_t simd_compact(const TValue* data, size_t n, TValue value, TValue* out)
+	{
+		switch (get_simd_level())
+		{
+#if defined(TINYLINQ_SIMD_AVX512)
+		case simd_level::avx512:	return simd_kernels_avx512::compact<op>(data, n, value, out);
+#endif
+#if defined(TINYLINQ_SIMD_X86)
+		case simd_level::avx2:		return simd_kernels_avx2::compact<op>(data, n, value, out);
+		case simd_level::sse2:		return simd_kernels_sse2::compact<op>(data, n, value, out);
+#endif
+		default:					return simd_kernels_scalar::compact<op>(data, n, value, out);
+		}
+	}
+
+	//where(compare_predicate) over a contiguous int/float/double source; anything else is left to the element loop
+	template<typename TRange>
+	struct simd_filter
+	{
+		static const bool value = false;
+	};
+
+	template<typename TSource, typename TValue, compare_op op>
+	struct simd_filter<where_range<TSource, compare_predicate<TValue, op>>>
+	{
+		static const bool value =
+			is_simd_range<TSource>::value &&
+			std::is_same<TValue, typename TSource::value_type>::value;
+
+		static size_t count(const where_range<TSource, compare_predicate<TValue, op>>& range)
+		{
+			const TSource& source = range.source_range();
+			return simd_count<op>(source.data(), source.size_hint().count, range.predicate_function().value);
+		}
+
+		static std::vector<TValue> to_vector(const where_range<TSource, compare_predicate<TValue, op>>& range)
+		{
+			const TSource& source = range.source_range();
+			size_t n = source.size_hint().count;
+			std::vector<TValue> ret(n);
+			if (n > 0)
+				ret.resize(simd_compact<op>(source.data(), n, range.predicate_function().value, &ret[0]));
+			if (ret.size() < n / 2)
+				ret.shrink_to_fit();
+			return ret;
+		}
+	};
+
+	//unit of work handed between workers, it lives on the stack of the thread that forked it
+	struct pool_task
+	{
+		void				(*invoke)(pool_task*);
+		std::atomic<bool>	done;
+		bool				external;		//an outside thread sleeps until it is done
+		std::exception_ptr	error;
+	};
+
+	template<typename TFunction>
+	struct closure_task : pool_task
+	{
+		explicit closure_task(const TFunction& _function)
+			:function(_function)
+		{
+			invoke = &closure_task::run;
+			done = false;
+			external = false;
+		}
+
+		static void run(pool_task* task)
+		{
+			closure_task* self = static_cast<closure_task*>(task);
+			try
+			{
+				self->function();
+			}
+			catch (...)
+			{
+				self->error = std::current_exception();
+			}
+			self->done.store(true, std::memory_order_release);
+		}
+
+		const TFunction& function;
+	};
+
+	//Chase-Lev deque: its owner pushes and pops at the bottom, other workers steal from the top
+	class work_stealing_deque
+	{
+	public:
+		work_stealing_deque()
+			:top(0)
+			,bottom(0)
+		{
+			rings.push_back(std::unique_ptr<ring>(new ring(64)));
+			buffer.store(rings.back().get());
+		}
+
+		void push(pool_task* task)
+		{
+			long long b = bottom.load(std::memory_order_relaxed);
+			long long t = top.load(std::memory_order_acquire);
+			ring* a = buffer.load(std::memory_order_relaxed);
+			if (b - t >= a->size())
+				a = grow(a, t, b);
+			a->put(b, task);
+			std::atomic_thread_fence(std::memory_order_release);
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+
+		pool_task* pop()
+		{
+			long long b = bottom.load(std::memory_order_relaxed) - 1;
+			ring* a = buffer.load(std::memory_order_relaxed);
+			bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			long long t = top.load(std::memory_order_relaxed);
+			if (t > b)
+			{
+				bottom.store(b + 1, std::memory_order_relaxed);
+				return NULL;
+			}
+
+			pool_task* task = a->get(b);
+			if (t == b)
+			{
+				if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					task = NULL;
+				bottom.store(b + 1, std::memory_order_relaxed);
+			}
+			return task;
+		}
+
+		pool_task* steal()
+		{
+			long long t = top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			long long b = bottom.load(std::memory_order_acquire);
+			if (t >= b)
+				return NULL;
+
+			ring* a = buffer.load(std::memory_order_acquire);
+			pool_task* task = a->get(t);
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				return NULL;
+			return task;
+		}
+
+	private:
+		class ring
+		{
+		public:
+			explicit ring(long long capacity)
+				:mask(capacity - 1)
+				,slots(new std::atomic<pool_task*>[static_cast<size_t>(capacity)])
+			{}
+
+			long long size() const
+			{
+				return mask + 1;
+			}
+
+			pool_task* get(long long index) const
+			{
+				return slots[static_cast<size_t>(index & mask)].load(std::memory_order_relaxed);
+			}
+
+			void put(long long index, pool_task* task)
+			{
+				slots[static_cast<size_t>(index & mask)].store(task, std::memory_order_relaxed);
+			}
+
+		private:
+			long long									mask;
+			std::unique_ptr<std::atomic<pool_task*>[]>	slots;
+		};
+
+		//thieves may still read the old ring, so it is kept alive until the deque goes away
+		ring* grow(ring* old_ring, long long t, long long b)
+		{
+			rings.push_back(std::unique_ptr<ring>(new ring(old_ring->size() * 2)));
+			ring* new_ring = rings.back().get();
+			for (long long i = t; i < b; ++i)
+				new_ring->put(i, old_ring->get(i));
+			buffer.store(new_ring, std::memory_order_release);
+			return new_ring;
+		}
+
+		std::atomic<long long>				top;
+		std::atomic<long long>				bottom;
+		std::atomic<ring*>					buffer;
+		std::vector<std::unique_ptr<ring>>	rings;
+	};
+
+	//fork/join pool: every worker owns a work_stealing_deque, forked halves are pushed there and
+	//stolen by idle workers, a joining worker keeps executing tasks until the one it waits for is done
+	class thread_pool
+	{
+	public:
+		explicit thread_pool(size_t thread_count = 0)
+			:stopping(false)
+			,sleeping(0)
+			,epoch(0)
+			,injected_count(0)
+		{
+			if (thread_count == 0)
+				thread_count = std::max<size_t>(1, std::thread::hardware_concurrency());
+			for (size_t i = 0; i < thread_count; ++i)
+				workers.push_back(std::unique_ptr<worker>(new worker(this, i)));
+			for (size_t i = 0; i < thread_count; ++i)
+				workers[i]->thread = std::thread(&thread_pool::work, this, workers[i].get());
+		}
+
+		~thread_pool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+				++epoch;
+			}
+			wake.notify_all();
+			for (size_t i = 0; i < workers.size(); ++i)
+				workers[i]->thread.join();
+		}
+
+		size_t size() const
+		{
+			return workers.size();
+		}
+
+		//body(from, to) over [begin, end), halved recursively until pieces are no larger than grain;
+		//idle workers steal the pending halves, which keeps them busy even when costs are skewed
+		template<typename TBody>
+		void parallel_for(size_t begin, size_t end, size_t grain, const TBody& body)
+		{
+			if (begin >= end)
+				return;
+			auto root = [&]()
+			{
+				split(begin, end, std::max<size_t>(grain, 1), body);
+			};
+			run_on_worker(root);
+		}
+
+		//run left and right, concurrently when a worker is free to steal right
+		template<typename TLeft, typename TRight>
+		void fork_join(const TLeft& left, const TRight& right)
+		{
+			auto root = [&]()
+			{
+				fork_join_on_worker(left, right);
+			};
+			run_on_worker(root);
+		}
+
+		static thread_pool& default_pool()
+		{
+			thread_pool* pool = default_override().load();
+			if (pool)
+				return *pool;
+			static thread_pool shared_pool;
+			return shared_pool;
+		}
+
+		//make pool the one as_parallel() uses, NULL restores the built in pool
+		static void set_default_pool(thread_pool* pool)
+		{
+			default_override().store(pool);
+		}
+
+	private:
+		struct worker
+		{
+			worker(thread_pool* _pool, size_t _index)
+				:pool(_pool)
+				,index(_index)
+			{}
+
+			thread_pool*		pool;
+			size_t				index;
+			work_stealing_deque	tasks;
+			std::thread			thread;
+		};
+
+		static std::atomic<thread_pool*>& default_override()
+		{
+			static std::atomic<thread_pool*> pool(NULL);
+			return pool;
+		}
+
+		static worker*& current_worker()
+		{
+			static thread_local worker* current = NULL;
+			return current;
+		}
+
+		template<typename TFunction>
+		void run_on_worker(const TFunction& function)
+		{
+			worker* self = current_worker();
+			if (self && self->pool == this)
+			{
+				function();
+				return;
+			}
+
+			//called from outside the pool: hand the root over and sleep until it is done
+			closure_task<TFunction> root(function);
+			root.external = true;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				injected.push_back(&root);
+				injected_count.fetch_add(1);
+				++epoch;
+			}
+			wake.notify_all();
+
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!root.done.load(std::memory_order_acquire))
+				finished.wait(lock);
+			lock.unlock();
+
+			if (root.error)
+				std::rethrow_exception(root.error);
+		}
+
+		template<typename TBody>
+		void split(size_t begin, size_t end, size_t grain, const TBody& body)
+		{
+			if (end - begin <= grain)
+			{
+				body(begin, end);
+				return;
+			}
+
+			size_t middle = begin + (end - begin) / 2;
+			auto left = [&]()
+			{
+				split(begin, middle, grain, body);
+			};
+			auto right = [&]()
+			{
+				split(middle, end, grain, body);
+			};
+			fork_join_on_worker(left, right);
+		}
+
+		template<typename TLeft, typename TRight>
+		void fork_join_on_worker(const TLeft& left, const TRight& right)
+		{
+			worker* self = current_worker();
+			closure_task<TRight> right_task(right);
+			self->tasks.push(&right_task);
+			notify_sleepers();
+
+			std::exception_ptr left_error;
+			try
+			{
+				left();
+			}
+			catch (...)
+			{
+				left_error = std::current_exception();
+			}
+
+			while (!right_task.done.load(std::memory_order_acquire))
+			{
+				pool_task* task = self->tasks.pop();
+				if (!task)
+					task = steal(self);
+				if (task)
+					execute(task);
+				else
+					std::this_thread::yield();
+			}
+
+			if (left_error)
+				std::rethrow_exception(left_error);
+			if (right_task.error)
+				std::rethrow_exception(right_task.error);
+		}
+
+		//the task may be gone as soon as it is done, so external is read up front
+		void execute(pool_task* task)
+		{
+			bool external = task->external;
+			task->invoke(task);
+			if (external)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				finished.notify_all();
+			}
+		}
+
+		pool_task* steal(worker* self)
+		{
+			if (injected_count.load() > 0)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!injected.empty())
+				{
+					pool_task* task = injected.front();
+					injected.pop_front();
+					injected_count.fetch_sub(1);
+					return task;
+				}
+			}
+
+			for (size_t i = 1; i < workers.size(); ++i)
+			{
+				pool_task* task = workers[(self->index + i) % workers.size()]->tasks.steal();
+				if (task)
+					return task;
+			}
+			return NULL;
+		}
+
+		void notify_sleepers()
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (sleeping.load() == 0)
+				return;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				++epoch;
+			}
+			wake.notify_all();
+		}
+
+		void work(worker* self)
+		{
+			current_worker() = self;
+			for (;;)
+			{
+				pool_task* task = self->tasks.pop();
+				if (!task)
+					task = steal(self);
+				if (task)
+				{
+					execute(task);
+					continue;
+				}
+
+				//announce the nap before the last look for work, so that a concurrent push sees it and bumps epoch
+				sleeping.fetch_add(1);
+				size_t seen_epoch;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					seen_epoch = epoch;
+				}
+				task = steal(self);
+				if (!task)
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					while (!stopping && epoch == seen_epoch)
+						wake.wait(lock);
+				}
+				sleeping.fetch_sub(1);
+
+				if (task)
+					execute(task);
+				else if (stopping)
+					return;
+			}
+		}
+
+		std::vector<std::unique_ptr<worker>>	workers;
+		std::deque<pool_task*>					injected;
+		std::mutex								mutex;
+		std::condition_variable					wake;
+		std::condition_variable					finished;
+		bool									stopping;
+		std::atomic<size_t>						sleeping;
+		size_t									epoch;
+		std::atomic<size_t>						injected_count;
+	};
+
+	template<typename TRange, bool limited = false>
+	class parallel_linq;
+
+	//single pass iterator, copies share one cursor over a copy of the range; end() has no cursor at all
+	template<typename TRange>
+	class range_iterator
+	{
+		struct cursor
+		{
+			explicit cursor(const TRange& _range)
+				:range(_range)
+				,is_end(!range.next())
+			{}
+
+			TRange	range;
+			bool	is_end;
+		};
+
+	public:
+		typedef std::input_iterator_tag					iterator_category;
+		typedef typename TRange::value_type				value_type;
+		typedef std::ptrdiff_t							difference_type;
+		typedef const value_type*						pointer;
+		typedef typename TRange::return_type			reference;
+
+		struct end_tag
+		{
+		};
+
+		//the cursor moves on under it++, so the element it was on is kept aside for *it++
+		class postfix_value
+		{
+		public:
+			explicit postfix_value(reference _value)
+				:value(_value)
+			{}
+
+			const value_type& operator*() const
+			{
+				return value;
+			}
+
+		private:
+			value_type	value;
+		};
+
+		explicit range_iterator(const TRange& _range)
+			:state(std::make_shared<cursor>(_range))
+		{}
+
+		range_iterator(const TRange&, end_tag)
+		{}
+
+		reference operator*() const
+		{
+			return state->range.front();
+		}
+
+		range_iterator& operator++()
+		{
+			state->is_end = !state->range.next();
+			return *this;
+		}
+
+		postfix_value operator++(int)
+		{
+			postfix_value ret(**this);
+			++*this;
+			return ret;
+		}
+
+		//single pass: only the comparison against end() is meaningful
+		bool operator==(const range_iterator& other) const
+		{
+			return is_end() == other.is_end();
+		}
+
+		bool operator!=(const range_iterator& other) const
+		{
+			return is_end() != other.is_end();
+		}
+
+	private:
+		bool is_end() const
+		{
+			return !state || state->is_end;
+		}
+
+		std::shared_ptr<cursor>	state;
+	};
+
+	//iterator over a random access range, positions are offsets passed to at(). copies share one copy of the range,
+	//which is only read through at() and never advanced: each copy keeps its own index, so moving one leaves the others in place
+	template<typename TRange>
+	class random_access_range_iterator
+	{
+	public:
+		typedef std::random_access_iterator_tag			iterator_category;
+		typedef typename TRange::value_type				value_type;
+		typedef std::ptrdiff_t							difference_type;
+		typedef const value_type*						pointer;
+		typedef typename TRange::return_type			reference;
+
+		random_access_range_iterator(const TRange& _range, size_t _index)
+			:range(std::make_shared<TRange>(_range))
+			,index(_index)
+		{}
+
+		reference operator*() const
+		{
+			return range->at(index);
+		}
+
+		pointer operator->() const
+		{
+			return &range->at(index);
+		}
+
+		reference operator[](difference_type n) const
+		{
+			return range->at(index + n);
+		}
+
+		random_access_range_iterator& operator++()
+		{
+			++index;
+			return *this;
+		}
+
+		random_access_range_iterator operator++(int)
+		{
+			random_access_range_iterator ret = *this;
+			++index;
+			return ret;
+		}
+
+		random_access_range_iterator& operator--()
+		{
+			--index;
+			return *this;
+		}
+
+		random_access_range_iterator operator--(int)
+		{
+			random_access_range_iterator ret = *this;
+			--index;
+			return ret;
+		}
+
+		random_access_range_iterator& operator+=(difference_type n)
+		{
+			index += n;
+			return *this;
+		}
+
+		random_access_range_iterator& operator-=(difference_type n)
+		{
+			index -= n;
+			return *this;
+		}
+
+		random_access_range_iterator operator+(difference_type n) const
+		{
+			random_access_range_iterator ret = *this;
+			return ret += n;
+		}
+
+		friend random_access_range_iterator operator+(difference_type n, const random_access_range_iterator& it)
+		{
+			return it + n;
+		}
+
+		random_access_range_iterator operator-(difference_type n) const
+		{
+			random_access_range_iterator ret = *this;
+			return ret -= n;
+		}
+
+		difference_type operator-(const random_access_range_iterator& other) const
+		{
+			return static_cast<difference_type>(index) - static_cast<difference_type>(other.index);
+		}
+
+		bool operator==(const random_access_range_iterator& other) const	{ return index == other.index; }
+		bool operator!=(const random_access_range_iterator& other) const	{ return index != other.index; }
+		bool operator<(const random_access_range_iterator& other) const		{ return index < other.index; }
+		bool operator>(const random_access_range_iterator& other) const		{ return index > other.index; }
+		bool operator<=(const random_access_range_iterator& other) const	{ return index <= other.index; }
+		bool operator>=(const random_access_range_iterator& other) const	{ return index >= other.index; }
+
+	private:
+		std::shared_ptr<TRange>	range;
+		size_t					index;
+	};
+
+	//random access ranges whose at() refers to the element itself, select hands out a slot the next at() overwrites
+	template<typename TRange>
+	struct has_indexed_references : std::integral_constant<bool,
+		TRange::is_random_access::value &&
+		std::is_reference<typename TRange::return_type>::value>
+	{
+	};
+
+	template<typename TRange, typename TFunction>
+	struct has_indexed_references<select_range<TRange, TFunction>> : std::false_type
+	{
+	};
+
+	template<typename TRange>
+	struct has_indexed_references<take_range<TRange>> : has_indexed_references<TRange>
+	{
+	};
+
+	template<typename TRange>
+	struct has_indexed_references<skip_range<TRange>> : has_indexed_references<TRange>
+	{
+	};
+
+	//random access when the range can index and hands out real references, single pass otherwise
+	template<typename TRange>
+	struct linq_iterator_type
+	{
+		typedef typename std::conditional<
+			has_indexed_references<TRange>::value,
+			random_access_range_iterator<TRange>,
+			range_iterator<TRange>>::type type;
+	};
+
+	template<typename TRange>
+	class linq
+	{
+	public:
+		linq(TRange _range)
+			:range(std::move(_range))
+		{}
+
+		typedef typename TRange::value_type		value_type;
+		typedef typename TRange::return_type	return_type;
+
+		//operators on an lvalue query copy it into the next stage, on an rvalue query they move it there
+		template<typename TFunction>
+		auto where(TFunction predicate) const&->linq<where_range<TRange, TFunction>>
+		{
+			return linq(*this).where(std::move(predicate));
+		}
+
+		template<typename TFunction>
+		auto where(TFunction predicate) &&->linq<where_range<TRange, TFunction>>
+		{
+			return linq<where_range<TRange, TFunction>>(where_range<TRange, TFunction>(std::move(range), std::move(predicate)));
+		}
+
+		template<typename TFunction>
+		auto select(TFunction function) const&->linq<select_range<TRange, TFunction>>
+		{
+			return linq(*this).select(std::move(function));
+		}
+
+		template<typename TFunction>
+		auto select(TFunction function) &&->linq<select_range<TRange, TFunction>>
+		{
+			return linq<select_range<TRange, TFunction>>(select_range<TRange, TFunction>(std::move(range), std::move(function)));
+		}
+
+		template<typename TFunction>
+		auto select_many(TFunction function) const&->linq<select_many_range<TRange, TFunction>>
+		{
+			return linq(*this).select_many(std::move(function));
+		}
+
+		template<typename TFunction>
+		auto select_many(TFunction function) &&->linq<select_many_range<TRange, TFunction>>
+		{
+			return linq<select_many_range<TRange, TFunction>>(select_many_range<TRange, TFunction>(std::move(range), std::move(function)));
+		}
+
+		auto concat(value_type value) const&->linq<concat_range<TRange, inline_range<value_type, 1>>>
+		{
+			return linq(*this).concat(std::move(value));
+		}
+
+		auto concat(value_type value) &&->linq<concat_range<TRange, inline_range<value_type, 1>>>
+		{
+			std::array<value_type, 1> values = {{std::move(value)}};
+			return std::move(*this).concat(linq<inline_range<value_type, 1>>(inline_range<value_type, 1>(std::move(values))));
+		}
+
+		template<typename TOtherRange>
+		auto concat(linq<TOtherRange> other_range) const&->linq<concat_range<TRange, TOtherRange>>
+		{
+			return linq(*this).concat(std::move(other_range));
+		}
+
+		template<typename TOtherRange>
+		auto concat(linq<TOtherRange> other_range) &&->linq<concat_range<TRange, TOtherRange>>
+		{
+			return linq<concat_range<TRange, TOtherRange>>(concat_range<TRange, TOtherRange>(std::move(range), std::move(other_range.range)));
+		}
+
+		auto ref() const&->linq<ref_range<TRange>>
+		{
+			return linq(*this).ref();
+		}
+
+		auto ref() &&->linq<ref_range<TRange>>
+		{
+			return linq<ref_range<TRange>>(ref_range<TRange>(std::move(range)));
+		}
+
+		auto take(int count) const&->linq<take_range<TRange>>
+		{
+			return linq(*this).take(count);
+		}
+
+		auto take(int count) &&->linq<take_range<TRange>>
+		{
+			return linq<take_range<TRange>>(take_range<TRange>(std::move(range), count));
+		}
+
+		auto skip(size_t count) const&->linq<skip_range<TRange>>
+		{
+			return linq(*this).skip(count);
+		}
+
+		auto skip(size_t count) &&->linq<skip_range<TRange>>
+		{
+			return linq<skip_range<TRange>>(skip_range<TRange>(std::move(range), count));
+		}
+
+		auto distinct() const&->linq<distinct_range<TRange, element_key>>
+		{
+			return linq(*this).distinct();
+		}
+
+		auto distinct() &&->linq<distinct_range<TRange, element_key>>
+		{
+			return linq<distinct_range<TRange, element_key>>(distinct_range<TRange, element_key>(std::move(range), element_key()));
+		}
+
+		//first element of each key, in query order
+		template<typename TFunction>
+		auto distinct_by(TFunction key_selector) const&->linq<distinct_range<TRange, TFunction>>
+		{
+			return linq(*this).distinct_by(std::move(key_selector));
+		}
+
+		template<typename TFunction>
+		auto distinct_by(TFunction key_selector) &&->linq<distinct_range<TRange, TFunction>>
+		{
+			return linq<distinct_range<TRange, TFunction>>(distinct_range<TRange, TFunction>(std::move(range), std::move(key_selector)));
+		}
+
+		//distinct elements of both sequences, this one's first
+		template<typename TOtherRange>
+		auto union_with(linq<TOtherRange> other_range) const&->linq<distinct_range<concat_range<TRange, TOtherRange>, element_key>>
+		{
+			return linq(*this).union_with(std::move(other_range));
+		}
+
+		template<typename TOtherRange>
+		auto union_with(linq<TOtherRange> other_range) &&->linq<distinct_range<concat_range<TRange, TOtherRange>, element_key>>
+		{
+			return std::move(*this).concat(std::move(other_range)).distinct();
+		}
+
+		template<typename TOtherRange>
+		auto intersect_with(linq<TOtherRange> other_range) const&->linq<set_operation_range<TRange, TOtherRange, set_mode::intersect>>
+		{
+			return linq(*this).intersect_with(std::move(other_range));
+		}
+
+		template<typename TOtherRange>
+		auto intersect_with(linq<TOtherRange> other_range) &&->linq<set_operation_range<TRange, TOtherRange, set_mode::intersect>>
+		{
+			typedef set_operation_range<TRange, TOtherRange, set_mode::intersect> result_type;
+			return linq<result_type>(result_type(std::move(range), std::move(other_range.range)));
+		}
+
+		template<typename TOtherRange>
+		auto except(linq<TOtherRange> other_range) const&->linq<set_operation_range<TRange, TOtherRange, set_mode::except>>
+		{
+			return linq(*this).except(std::move(other_range));
+		}
+
+		template<typename TOtherRange>
+		auto except(linq<TOtherRange> other_range) &&->linq<set_operation_range<TRange, TOtherRange, set_mode::except>>
+		{
+			typedef set_operation_range<TRange, TOtherRange, set_mode::except> result_type;
+			return linq<result_type>(result_type(std::move(range), std::move(other_range.range)));
+		}
+
+		//walks arrays, vectors and other bidirectional sources backwards in place, through select and ref;
+		//anything else is buffered once
+		auto reverse() const&->linq<typename reversed_range<TRange>::type>
+		{
+			return linq(*this).reverse();
+		}
+
+		auto reverse() &&->linq<typename reversed_range<TRange>::type>
+		{
+			typedef typename reversed_range<TRange>::type result_type;
+			return linq<result_type>(result_type(std::move(range)));
+		}
+
+		//groups of elements sharing a key, in order of the key's first appearance
+		template<typename TFunction>
+		auto group_by(TFunction key_selector) const&->linq<group_range<TRange, TFunction>>
+		{
+			return linq(*this).group_by(std::move(key_selector));
+		}
+
+		template<typename TFunction>
+		auto group_by(TFunction key_selector) &&->linq<group_range<TRange, TFunction>>
+		{
+			return linq<group_range<TRange, TFunction>>(group_range<TRange, TFunction>(std::move(range), std::move(key_selector)));
+		}
+
+		//(key, accumulate(...accumulate(init, e1)..., en)) per key, keeping only the accumulators
+		template<typename TKeySelector, typename TAccumulate, typename TAccumulateFunction>
+		auto aggregate_by(TKeySelector key_selector, TAccumulate init, TAccumulateFunction accumulate) const&
+			->linq<aggregate_by_range<TRange, TKeySelector, TAccumulate, TAccumulateFunction>>
+		{
+			return linq(*this).aggregate_by(std::move(key_selector), std::move(init), std::move(accumulate));
+		}
+
+		template<typename TKeySelector, typename TAccumulate, typename TAccumulateFunction>
+		auto aggregate_by(TKeySelector key_selector, TAccumulate init, TAccumulateFunction accumulate) &&
+			->linq<aggregate_by_range<TRange, TKeySelector, TAccumulate, TAccumulateFunction>>
+		{
+			typedef aggregate_by_range<TRange, TKeySelector, TAccumulate, TAccumulateFunction> result_type;
+			return linq<result_type>(result_type(std::move(range), std::move(key_selector), std::move(init), std::move(accumulate)));
+		}
+
+		//a group per run of equal consecutive keys: group_by for input already sorted by the key,
+		//holding one run at a time
+		template<typename TFunction>
+		auto group_adjacent(TFunction key_selector) const&->linq<group_adjacent_range<TRange, TFunction>>
+		{
+			return linq(*this).group_adjacent(std::move(key_selector));
+		}
+
+		template<typename TFunction>
+		auto group_adjacent(TFunction key_selector) &&->linq<group_adjacent_range<TRange, TFunction>>
+		{
+			return linq<group_adjacent_range<TRange, TFunction>>(group_adjacent_range<TRange, TFunction>(std::move(range), std::move(key_selector)));
+		}
+
+		//aggregate_by for input already sorted by the key, in constant memory
+		template<typename TKeySelector, typename TAccumulate, typename TAccumulateFunction>
+		auto aggregate_adjacent(TKeySelector key_selector, TAccumulate init, TAccumulateFunction accumulate) const&
+			->linq<aggregate_adjacent_range<TRange, TKeySelector, TAccumulate, TAccumulateFunction>>
+		{
+			return linq(*this).aggregate_adjacent(std::move(key_selector), std::move(init), std::move(accumulate));
+		}
+
+		template<typename TKeySelector, typename TAccumulate, typename TAccumulateFunction>
+		auto aggregate_adjacent(TKeySelector key_selector, TAccumulate init, TAccumulateFunction accumulate) &&
+			->linq<aggregate_adjacent_range<TRange, TKeySelector, TAccumulate, TAccumulateFunction>>
+		{
+			typedef aggregate_adjacent_range<TRange, TKeySelector, TAccumulate, TAccumulateFunction> result_type;
+			return linq<result_type>(result_type(std::move(range), std::move(key_selector), std::move(init), std::move(accumulate)));
+		}
+
+		auto distinct_until_changed() const&->linq<distinct_until_changed_range<TRange>>
+		{
+			return linq(*this).distinct_until_changed();
+		}
+
+		auto distinct_until_changed() &&->linq<distinct_until_changed_range<TRange>>
+		{
+			return linq<distinct_until_changed_range<TRange>>(distinct_until_changed_range<TRange>(std::move(range)));
+		}
+
+		template<typename TFunction>
+		auto order_by(TFunction key_selector) const&->linq<order_range<TRange, TFunction>>
+		{
+			return linq(*this).order_by(std::move(key_selector));
+		}
+
+		template<typename TFunction>
+		auto order_by(TFunction key_selector) &&->linq<order_range<TRange, TFunction>>
+		{
+			return linq<order_range<TRange, TFunction>>(order_range<TRange, TFunction>(std::move(range), std::move(key_selector), false));
+		}
+
+		template<typename TFunction>
+		auto order_by_descending(TFunction key_selector) const&->linq<order_range<TRange, TFunction>>
+		{
+			return linq(*this).order_by_descending(std::move(key_selector));
+		}
+
+		template<typename TFunction>
+		auto order_by_descending(TFunction key_selector) &&->linq<order_range<TRange, TFunction>>
+		{
+			return linq<order_range<TRange, TFunction>>(order_range<TRange, TFunction>(std::move(range), std::move(key_selector), true));
+		}
+
+		//only after order_by or order_by_descending
+		template<typename TFunction>
+		auto then_by(TFunction key_selector) const&->linq<typename then_by_range<TRange, TFunction>::type>
+		{
+			return linq(*this).then_by(std::move(key_selector));
+		}
+
+		template<typename TFunction>
+		auto then_by(TFunction key_selector) &&->linq<typename then_by_range<TRange, TFunction>::type>
+		{
+			return linq<typename then_by_range<TRange, TFunction>::type>(range.then_by(std::move(key_selector), false));
+		}
+
+		template<typename TFunction>
+		auto then_by_descending(TFunction key_selector) const&->linq<typename then_by_range<TRange, TFunction>::type>
+		{
+			return linq(*this).then_by_descending(std::move(key_selector));
+		}
+
+		template<typename TFunction>
+		auto then_by_descending(TFunction key_selector) &&->linq<typename then_by_range<TRange, TFunction>::type>
+		{
+			return linq<typename then_by_range<TRange, TFunction>::type>(range.then_by(std::move(key_selector), true));
+		}
+
+		template<typename TOtherRange,typename TKeySelector,typename TOtherKeySelector,typename TCombiner>
+		auto join(
+			linq<TOtherRange> other_range,
+			TKeySelector key_selector,
+			TOtherKeySelector other_key_selector,
+			TCombiner combinner,
+			join_mode mode = join_mode::automatic) const&->
+			linq<join_range<
+			TRange,
+			TOtherRange,
+			TKeySelector,
+			TOtherKeySelector,
+			TCombiner >>
+		{
+			return linq(*this).join(
+				std::move(other_range),
+				std::move(key_selector),
+				std::move(other_key_selector),
+				std::move(combinner),
+				mode);
+		}
+
+		template<typename TOtherRange,typename TKeySelector,typename TOtherKeySelector,typename TCombiner>
+		auto join(
+			linq<TOtherRange> other_range,
+			TKeySelector key_selector,
+			TOtherKeySelector other_key_selector,
+			TCombiner combinner,
+			join_mode mode = join_mode::automatic) &&->
+			linq<join_range<
+			TRange,
+			TOtherRange,
+			TKeySelector,
+			TOtherKeySelector,
+			TCombiner >>
+		{
+			typedef join_range<
+				TRange,
+				TOtherRange,
+				TKeySelector,
+				TOtherKeySelector,
+				TCombiner> result_type;
+			return linq<result_type>(result_type(
+				std::move(range),
+				std::move(other_range.range),
+				std::move(key_selector),
+				std::move(other_key_selector),
+				std::move(combinner),
+				mode));
+		}
+
+		//terminals on an lvalue query run on a copy of it, on an rvalue query they consume it in place
+		template<typename TFunction>
+		auto aggregate(typename TRange::value_type init_value, const TFunction& function) const&
+			->typename TRange::value_type
+		{
+			return linq(*this).aggregate(std::move(init_value), function);
+		}
+
+		template<typename TFunction>
+		auto aggregate(typename TRange::value_type init_value, const TFunction& function) &&
+			->typename TRange::value_type
+		{
+			for_each_batch(range, [&](const value_type* values, size_t n)
+			{
+				//local accumulator: init_value could alias the batch as far as the compiler knows
+				value_type value = std::move(init_value);
+				for (size_t i = 0; i < n; ++i)
+				{
+					value = function(value, values[i]);
+				}
+				init_value = std::move(value);
+			});
+			return init_value;
+		}
+
+		//same shape as the parallel_linq overload, combine is only needed there
+		template<typename TAccumulate, typename TAccumulateFunction, typename TCombineFunction>
+		TAccumulate aggregate(
+			TAccumulate identity,
+			const TAccumulateFunction& accumulate,
+			const TCombineFunction& combine) const&
+		{
+			return linq(*this).aggregate(std::move(identity), accumulate, combine);
+		}
+
+		template<typename TAccumulate, typename TAccumulateFunction, typename TCombineFunction>
+		TAccumulate aggregate(
+			TAccumulate identity,
+			const TAccumulateFunction& accumulate,
+			const TCombineFunction&) &&
+		{
+			for_each_batch(range, [&](const value_type* values, size_t n)
+			{
+				TAccumulate value = std::move(identity);
+				for (size_t i = 0; i < n; ++i)
+				{
+					value = accumulate(value, values[i]);
+				}
+				identity = std::move(value);
+			});
+			return identity;
+		}
+
+		//any
+		template<typename TFunction>
+		bool any(const TFunction& function) const&
+		{
+			return linq(*this).any(function);
+		}
+
+		template<typename TFunction>
+		bool any(const TFunction& function) &&
+		{
+			while (range.next())
+			{
+				if (function(range.front()))
+					return true;
 			}
-			else
+			return false;
+		}
+
+		template<typename TFunction>
+		bool all(const TFunction& function) const&
+		{
+			return linq(*this).all(function);
+		}
+
+		template<typename TFunction>
+		bool all(const TFunction& function) &&
+		{
+			while (range.next())
+			{
+				if (!function(range.front()))
+					return false;
+			}
+			return true;
+		}
+
+		size_t count() const&
+		{
+			range_size hint = range.size_hint();
+			if (hint.is_exact)
+				return hint.count;
+			return linq(*this).count();
+		}
+
+		size_t count() &&
+		{
+			range_size hint = range.size_hint();
+			if (hint.is_exact)
+				return hint.count;
+			return count(std::integral_constant<bool, simd_filter<TRange>::value>());
+		}
+
+		//int, float and double elements of an array or vector are summed and compared with vector instructions
+		value_type sum() const&
+		{
+			return linq(*this).sum();
+		}
+
+		value_type sum() &&
+		{
+			return sum(std::integral_constant<bool, is_simd_range<TRange>::value>());
+		}
+
+		value_type min() const&
+		{
+			return linq(*this).min();
+		}
+
+		value_type min() &&
+		{
+			return min(std::integral_constant<bool, is_simd_range<TRange>::value>());
+		}
+
+		value_type max() const&
+		{
+			return linq(*this).max();
+		}
+
+		value_type max() &&
+		{
+			return max(std::integral_constant<bool, is_simd_range<TRange>::value>());
+		}
+
+		value_type element_at(size_t index) const&
+		{
+			return linq(*this).element_at(index);
+		}
+
+		value_type element_at(size_t index) &&
+		{
+			return element_at(index, typename TRange::is_random_access());
+		}
+
+		//pulls a single element, so after order_by only the smallest one gets sorted
+		value_type first() const&
+		{
+			return linq(*this).first();
+		}
+
+		value_type first() &&
+		{
+			if (!range.next())
+				throw std::out_of_range("first: sequence contains no elements");
+			return range.front();
+		}
+
+		value_type last() const&
+		{
+			return linq(*this).last();
+		}
+
+		value_type last() &&
+		{
+			return last(typename TRange::is_random_access());
+		}
+
+		template<typename TOtherRange>
+		bool sequence_equal(linq<TOtherRange> other_range) const&
+		{
+			return linq(*this).sequence_equal(std::move(other_range));
+		}
+
+		template<typename TOtherRange>
+		bool sequence_equal(linq<TOtherRange> other_range) &&
+		{
+			range_size hint = range.size_hint();
+			range_size other_hint = other_range.range.size_hint();
+			if ((hint.is_exact && hint.count > other_hint.count) ||
+				(other_hint.is_exact && other_hint.count > hint.count))
+			{
+				return false;
+			}
+
+			bool range_next = range.next();
+			bool other_range_next = other_range.range.next();
+		
+			while (range_next && other_range_next)
+			{
+				if (range.front() != other_range.range.front())
+				{
+					return false;
+				}
+				range_next = range.next();
+				other_range_next = other_range.range.next(); 
+			}
+
+			if (range_next!=other_range_next)
 			{
 				return false;
 			}
+
+			return true;
+		}
+
+		auto to_vector() const&->std::vector<typename TRange::value_type>
+		{
+			return linq(*this).to_vector();
+		}
+
+		auto to_vector() &&->std::vector<typename TRange::value_type>
+		{
+			return to_vector(std::integral_constant<bool, simd_filter<TRange>::value>());
+		}
+
+		auto to_deque() const&->std::deque<value_type>
+		{
+			return linq(*this).to_deque();
+		}
+
+		auto to_deque() &&->std::deque<value_type>
+		{
+			std::deque<value_type> d;
+			append_to(d, std::integral_constant<bool, is_batchable<value_type>::value>());
+			return d;
+		}
+
+		auto to_set() const&->std::set<value_type>
+		{
+			return linq(*this).to_set();
+		}
+
+		auto to_set() &&->std::set<value_type>
+		{
+			std::set<value_type> s;
+			append_to(s, std::integral_constant<bool, is_batchable<value_type>::value>());
+			return s;
+		}
+
+		auto to_unordered_set() const&->std::unordered_set<value_type>
+		{
+			return linq(*this).to_unordered_set();
+		}
+
+		auto to_unordered_set() &&->std::unordered_set<value_type>
+		{
+			std::unordered_set<value_type> s;
+			range_size hint = range.size_hint();
+			if (hint.is_exact)
+				s.reserve(hint.count);
+			append_to(s, std::integral_constant<bool, is_batchable<value_type>::value>());
+			return s;
+		}
+
+		//keyed sinks fill the container in one pass, the first element of each key wins
+		template<typename TKeySelector, typename TValueSelector>
+		auto to_unordered_map(const TKeySelector& key_selector, const TValueSelector& value_selector) const&
+			->typename keyed_sink_types<TRange, TKeySelector, TValueSelector>::unordered_map_type
+		{
+			return linq(*this).to_unordered_map(key_selector, value_selector);
+		}
+
+		template<typename TKeySelector, typename TValueSelector>
+		auto to_unordered_map(const TKeySelector& key_selector, const TValueSelector& value_selector) &&
+			->typename keyed_sink_types<TRange, TKeySelector, TValueSelector>::unordered_map_type
+		{
+			typename keyed_sink_types<TRange, TKeySelector, TValueSelector>::unordered_map_type m;
+			range_size hint = range.size_hint();
+			if (hint.is_exact)
+				m.reserve(hint.count);
+			fill_map(m, key_selector, value_selector);
+			return m;
+		}
+
+		template<typename TKeySelector, typename TValueSelector>
+		auto to_map(const TKeySelector& key_selector, const TValueSelector& value_selector) const&
+			->typename keyed_sink_types<TRange, TKeySelector, TValueSelector>::map_type
+		{
+			return linq(*this).to_map(key_selector, value_selector);
+		}
+
+		template<typename TKeySelector, typename TValueSelector>
+		auto to_map(const TKeySelector& key_selector, const TValueSelector& value_selector) &&
+			->typename keyed_sink_types<TRange, TKeySelector, TValueSelector>::map_type
+		{
+			typename keyed_sink_types<TRange, TKeySelector, TValueSelector>::map_type m;
+			fill_map(m, key_selector, value_selector);
+			return m;
+		}
+
+		//one to many: every value of a key, in query order, contiguous in a sealed flat_hash_multimap
+		template<typename TKeySelector, typename TValueSelector>
+		auto to_lookup(const TKeySelector& key_selector, const TValueSelector& value_selector) const&
+			->typename keyed_sink_types<TRange, TKeySelector, TValueSelector>::lookup_type
+		{
+			return linq(*this).to_lookup(key_selector, value_selector);
+		}
+
+		template<typename TKeySelector, typename TValueSelector>
+		auto to_lookup(const TKeySelector& key_selector, const TValueSelector& value_selector) &&
+			->typename keyed_sink_types<TRange, TKeySelector, TValueSelector>::lookup_type
+		{
+			typedef keyed_sink_types<TRange, TKeySelector, TValueSelector> types;
+			typename types::lookup_type lookup;
+			range_size hint = range.size_hint();
+			if (hint.is_exact)
+				lookup.reserve(hint.count);
+			while (range.next())
+			{
+				const value_type& value = range.front();
+				lookup.insert(typename types::key_type(key_selector(value)), typename types::mapped_type(value_selector(value)));
+			}
+			lookup.seal();
+			return lookup;
+		}
+
+		typedef typename linq_iterator_type<TRange>::type	iterator;
+		typedef iterator									const_iterator;
+
+		//begin() and end() each take one copy of the query and the iterators copied from them share it,
+		//so results can stream into std algorithms and range-for without copying the pipeline per step
+		iterator begin() const
+		{
+			return begin(std::is_same<iterator, range_iterator<TRange>>());
+		}
+
+		iterator end() const
+		{
+			return end(std::is_same<iterator, range_iterator<TRange>>());
+		}
+
+		//evaluate the rest of the query on the default thread_pool
+		auto as_parallel() const&->parallel_linq<TRange>
+		{
+			return parallel_linq<TRange>(range, thread_pool::default_pool());
+		}
+
+		auto as_parallel() &&->parallel_linq<TRange>
+		{
+			return parallel_linq<TRange>(std::move(range), thread_pool::default_pool());
+		}
+
+		auto as_parallel(thread_pool& pool) const&->parallel_linq<TRange>
+		{
+			return parallel_linq<TRange>(range, pool);
+		}
+
+		auto as_parallel(thread_pool& pool) &&->parallel_linq<TRange>
+		{
+			return parallel_linq<TRange>(std::move(range), pool);
+		}
+
+		TRange range;
+
+	private:
+		iterator begin(std::true_type) const
+		{
+			return iterator(range);
+		}
+
+		iterator begin(std::false_type) const
+		{
+			return iterator(range, 0);
+		}
+
+		iterator end(std::true_type) const
+		{
+			return iterator(range, typename iterator::end_tag());
+		}
+
+		iterator end(std::false_type) const
+		{
+			return iterator(range, range.size_hint().count);
+		}
+
+		size_t count(std::true_type)
+		{
+			return simd_filter<TRange>::count(range);
+		}
+
+		//only steps the range, a batch would copy every surviving element just to count it
+		size_t count(std::false_type)
+		{
+			size_t ret = 0;
+			while (range.next())
+			{
+				++ret;
+			}
+			return ret;
 		}
 
-		return_type front()
+		std::vector<value_type> to_vector(std::true_type)
 		{
-			return range.front();
+			return simd_filter<TRange>::to_vector(range);
 		}
-	private:
-		TRange	range;
-		int		count;
-	};
 
-	template<typename TRange,typename TOtherRange>
-	class concat_range
-	{
-	public:
-		typedef typename TRange::value_type			value_type;
-		typedef typename TRange::return_type	return_type;
-
-		concat_range(const TRange& _range, const TOtherRange& _other_range)
-			:range(_range)
-			,other_range(_other_range)
-			,is_visit_first_range(true)
-		{}
+		std::vector<value_type> to_vector(std::false_type)
+		{
+			std::vector<value_type> v;
+			range_size hint = range.size_hint();
+			if (hint.is_exact)
+				v.reserve(hint.count);
+			append_to(v, std::integral_constant<bool, is_batchable<value_type>::value>());
+			return v;
+		}
 
-		bool next()
+		//batches in our own buffer, or in storage only this pipeline holds, are moved into c
+		template<typename TContainer>
+		void append_to(TContainer& c, std::true_type)
 		{
-			if (range.next())
+			bool owned = elements_owned(range);
+			std::vector<value_type> buffer(batch_size);
+			const value_type* values = NULL;
+			size_t n;
+			while ((n = pull_batch(range, values, &buffer[0], batch_size)) > 0)
 			{
-				return true;
+				if (owned || values == &buffer[0])
+				{
+					value_type* first = const_cast<value_type*>(values);
+					insert_batch(c, std::make_move_iterator(first), std::make_move_iterator(first + n));
+				}
+				else
+				{
+					insert_batch(c, values, values + n);
+				}
 			}
+		}
 
-			if (other_range.next())
+		template<typename TContainer>
+		void append_to(TContainer& c, std::false_type)
+		{
+			if (!elements_owned(range))
 			{
-				is_visit_first_range = false;
-				return true;
+				while (range.next())
+				{
+					insert_front(c, std::false_type());
+				}
+				return;
+			}
+			while (range.next())
+			{
+				insert_front(c, std::integral_constant<bool,
+					owns_elements<TRange>::value &&
+					std::is_reference<return_type>::value>());
 			}
+		}
 
-			return false;		
+		template<typename TContainer>
+		void insert_front(TContainer& c, std::true_type)
+		{
+			const value_type& value = range.front();
+			c.insert(c.end(), std::move(const_cast<value_type&>(value)));
 		}
 
-		return_type front()
+		template<typename TContainer>
+		void insert_front(TContainer& c, std::false_type)
 		{
-			if (is_visit_first_range)
-				return range.front();
-			else
-				return other_range.front();
+			c.insert(c.end(), range.front());
 		}
-	private:
-		TRange		range;
-		TOtherRange	other_range;
-		bool		is_visit_first_range;
-	};
 
-	template<
-		typename TRange,
-		typename TOtherRange,
-		typename TKeySelector,
-		typename TOtherKeySelector,
-		typename TCombiner>
-	class join_range
-	{
-	public:
+		template<typename TContainer, typename TIterator>
+		static void insert_batch(TContainer& c, TIterator first, TIterator last)
+		{
+			c.insert(c.end(), first, last);
+		}
 
-		typedef typename extract_return_type<TKeySelector,typename TRange::value_type>::type				raw_key_type;
-		typedef typename cleanup_type<raw_key_type>::type													key_type;
-		typedef typename extract_return_type<TOtherKeySelector,typename TOtherRange::value_type>::type		raw_other_key_type;
-		typedef typename cleanup_type<raw_other_key_type>::type												other_key_type;
-		typedef typename std::multimap<other_key_type, typename TOtherRange::value_type>					map_type;
-		typedef typename map_type::iterator																	map_iterator_type;
-		typedef typename extract_return_type_2_args<
-			TCombiner,
-			typename TRange::value_type,
-			typename TOtherRange::value_type>::type															return_type;
-		typedef typename cleanup_type<return_type>::type													value_type;
+		template<typename TIterator>
+		static void insert_batch(std::set<value_type>& c, TIterator first, TIterator last)
+		{
+			c.insert(first, last);
+		}
 
+		template<typename TIterator>
+		static void insert_batch(std::unordered_set<value_type>& c, TIterator first, TIterator last)
+		{
+			c.insert(first, last);
+		}
 
-		join_range(
-			const TRange&				_range,
-			const TOtherRange&			_other_range,
-			const TKeySelector&			_key_selector,
-			const TOtherKeySelector&	_other_key_selector,
-			const TCombiner&			_combiner)
-			:key_selector(_key_selector)
-			,other_key_selector(_other_key_selector)
-			,range(_range)
-			,other_range(_other_range)
-			,combiner(_combiner)
-			,is_first_visit(true)
+		//selectors read each element where front() has it, buffering them first would only add a copy
+		template<typename TMap, typename TKeySelector, typename TValueSelector>
+		void fill_map(TMap& m, const TKeySelector& key_selector, const TValueSelector& value_selector)
 		{
+			while (range.next())
+			{
+				const value_type& value = range.front();
+				m.emplace(key_selector(value), value_selector(value));
+			}
+		}
 
+		value_type sum(std::true_type)
+		{
+			return simd_sum(range.data(), range.size_hint().count);
 		}
 
-		bool next()
+		value_type sum(std::false_type)
 		{
-			if (is_first_visit)
+			value_type ret = value_type();
+			for_each_batch(range, [&](const value_type* values, size_t n)
 			{
-				is_first_visit = false;
-				while (other_range.next())
+				value_type value = std::move(ret);
+				for (size_t i = 0; i < n; ++i)
 				{
-					auto value = other_range.front();
-					auto key = other_key_selector(value);
-					cache.insert(make_pair<key_type,TOtherRange::value_type>(std::move(key), std::move(value)));
+					value += values[i];
 				}
+				ret = std::move(value);
+			});
+			return ret;
+		}
 
-				cache_iterator = cache.end();
-			}
-
-			if (cache.empty())
-				return false;
+		value_type min(std::true_type)
+		{
+			size_t n = range.size_hint().count;
+			if (n == 0)
+				throw std::out_of_range("min: sequence contains no elements");
+			return simd_minimum(range.data(), n);
+		}
 
-			if (cache_iterator != cache.end())
+		value_type min(std::false_type)
+		{
+			if (!range.next())
+				throw std::out_of_range("min: sequence contains no elements");
+			value_type ret = range.front();
+			for_each_batch(range, [&](const value_type* values, size_t n)
 			{
-				auto prev = cache_iterator;
-				++cache_iterator;
-				if (cache_iterator != cache.end() && prev->first == cache_iterator->first)
+				const value_type* lowest = &ret;
+				for (size_t i = 0; i < n; ++i)
 				{
-					return true;
-				}				
-			}
+					if (values[i] < *lowest)
+						lowest = values + i;
+				}
+				if (lowest != &ret)
+					ret = *lowest;
+			});
+			return ret;
+		}
 
-			while (range.next())
+		value_type max(std::true_type)
+		{
+			size_t n = range.size_hint().count;
+			if (n == 0)
+				throw std::out_of_range("max: sequence contains no elements");
+			return simd_maximum(range.data(), n);
+		}
+
+		value_type max(std::false_type)
+		{
+			if (!range.next())
+				throw std::out_of_range("max: sequence contains no elements");
+			value_type ret = range.front();
+			for_each_batch(range, [&](const value_type* values, size_t n)
 			{
-				key_type key = key_selector(range.front());
-				cache_iterator = cache.find(key);
-				if (cache_iterator != cache.end())
+				const value_type* highest = &ret;
+				for (size_t i = 0; i < n; ++i)
 				{
-					return true;
+					if (*highest < values[i])
+						highest = values + i;
 				}
+				if (highest != &ret)
+					ret = *highest;
+			});
+			return ret;
+		}
+
+		value_type element_at(size_t index, std::true_type)
+		{
+			if (index >= range.size_hint().count)
+				throw std::out_of_range("element_at: index out of range");
+			return range.at(index);
+		}
+
+		value_type element_at(size_t index, std::false_type)
+		{
+			for (size_t i = 0; i <= index; ++i)
+			{
+				if (!range.next())
+					throw std::out_of_range("element_at: index out of range");
 			}
+			return range.front();
+		}
 
-			return false;
+		value_type last(std::true_type)
+		{
+			size_t count = range.size_hint().count;
+			if (count == 0)
+				throw std::out_of_range("last: sequence contains no elements");
+			return range.at(count - 1);
 		}
 
-		return_type front()
+		value_type last(std::false_type)
 		{
-			return combiner(range.front(), cache_iterator->second);
+			if (!range.next())
+				throw std::out_of_range("last: sequence contains no elements");
+			value_type ret = range.front();
+			while (range.next())
+			{
+				ret = range.front();
+			}
+			return ret;
 		}
+	};
 
-	private:
-		TKeySelector		key_selector;
-		TOtherKeySelector	other_key_selector;
-		TRange				range;
-		TOtherRange			other_range;
-		TCombiner			combiner;
-		bool				is_first_visit;
-		map_type			cache;
-		map_iterator_type	cache_iterator;
+
+
+	const size_t cache_line_size = 64;
+
+	//allocator for over-aligned types, which the default one only honours from C++17 on. the block
+	//operator new returned is kept just before the aligned elements
+	template<typename T>
+	struct aligned_allocator
+	{
+		typedef T value_type;
+
+		static_assert(std::alignment_of<T>::value >= sizeof(void*), "aligned_allocator: use std::allocator for this type");
+
+		aligned_allocator()
+		{}
+
+		template<typename U>
+		aligned_allocator(const aligned_allocator<U>&)
+		{}
+
+		T* allocate(size_t n)
+		{
+			const size_t alignment = std::alignment_of<T>::value;
+			char* block = static_cast<char*>(::operator new(n * sizeof(T) + alignment));
+			char* aligned = block + alignment - reinterpret_cast<size_t>(block) % alignment;
+			reinterpret_cast<void**>(aligned)[-1] = block;
+			return reinterpret_cast<T*>(aligned);
+		}
+
+		void deallocate(T* p, size_t)
+		{
+			::operator delete(reinterpret_cast<void**>(p)[-1]);
+		}
 	};
 
+	template<typename T, typename U>
+	bool operator==(const aligned_allocator<T>&, const aligned_allocator<U>&)
+	{
+		return true;
+	}
 
-	template<typename TRange>
-	class linq
+	template<typename T, typename U>
+	bool operator!=(const aligned_allocator<T>&, const aligned_allocator<U>&)
 	{
-	public:
-		linq(const TRange& _range)
-			:range(_range)
+		return false;
+	}
+
+	//per chunk partial result on its own cache line, so that neighbouring workers do not false share;
+	//the alignment also rounds the size up to whole lines
+	template<typename TValue>
+	struct alignas(cache_line_size) cache_padded
+	{
+		explicit cache_padded(const TValue& _value)
+			:value(_value)
 		{}
 
-		//todo add move copy here
+		TValue	value;
+	};
+
+	//source positions per parallel chunk, small enough for stealing to even out skewed per element costs
+	const size_t parallel_min_chunk = 1024;
 
+	//as_parallel() view of a query: splittable pipelines (where/select/ref over arrays, vectors and from_copy)
+	//are cut into chunks evaluated on a thread_pool and merged in order, other ranges run as a single chunk
+	template<typename TRange, bool limited>
+	class parallel_linq
+	{
+	public:
 		typedef typename TRange::value_type		value_type;
 		typedef typename TRange::return_type	return_type;
+		typedef typename TRange::slice_type		slice_type;
+
+		parallel_linq(TRange _range, thread_pool& _pool, size_t _limit = size_t(-1))
+			:range(std::move(_range))
+			,pool(&_pool)
+			,limit(_limit)
+		{}
 
+		//like linq's operators: an lvalue query is copied into the next stage, an rvalue query is moved there
 		template<typename TFunction>
-		auto where(const TFunction& predicate)->linq<where_range<TRange, TFunction>>
+		auto where(TFunction predicate) const&->parallel_linq<where_range<TRange, TFunction>>
 		{
-			auto result = where_range<TRange, TFunction>(range, predicate);
-			return linq<where_range<TRange, TFunction>>(result);
+			return parallel_linq(*this).where(std::move(predicate));
 		}
 
 		template<typename TFunction>
-		auto select(const TFunction& function)->linq<select_range<TRange, TFunction>>
+		auto where(TFunction predicate) &&->parallel_linq<where_range<TRange, TFunction>>
 		{
-			auto result = select_range<TRange, TFunction>(range, function);
-			return linq<select_range<TRange, TFunction>>(result);
+			static_assert(!limited, "where() after take() changes which elements are taken, call it before take()");
+			return parallel_linq<where_range<TRange, TFunction>>(where_range<TRange, TFunction>(std::move(range), std::move(predicate)), *pool);
 		}
 
 		template<typename TFunction>
-		auto select_many(const TFunction& function)->linq<select_many_range<TRange, TFunction>>
+		auto select(TFunction function) const&->parallel_linq<select_range<TRange, TFunction>>
 		{
-			auto result = select_many_range<TRange, TFunction>(range, function);
-			return linq<select_many_range<TRange, TFunction>>(result);
+			return parallel_linq(*this).select(std::move(function));
 		}
 
-		template<typename TValue>
-		struct get_range_type_helper
+		template<typename TFunction>
+		auto select(TFunction function) &&->parallel_linq<select_range<TRange, TFunction>>
 		{
-			typedef typename storage_range<std::vector<typename cleanup_type<TValue>::type>> type;
-		};
+			static_assert(!limited, "select() after take() is not supported, call it before take()");
+			return parallel_linq<select_range<TRange, TFunction>>(select_range<TRange, TFunction>(std::move(range), std::move(function)), *pool);
+		}
 
-		auto concat(const typename TRange::value_type value)->linq<concat_range<TRange, typename get_range_type_helper<typename TRange::value_type>::type>>
+		auto ref() const&->parallel_linq<ref_range<TRange>>
 		{
-			return concat(single(value));			
+			return parallel_linq(*this).ref();
 		}
 
-		template<typename TOtherRange>
-		auto concat(const linq<TOtherRange>& other_range)->linq<concat_range<TRange, TOtherRange>>
+		auto ref() &&->parallel_linq<ref_range<TRange>>
 		{
-			auto result = concat_range<TRange, TOtherRange>(range, other_range.range);
-			return linq<concat_range<TRange, TOtherRange>>(result);
+			static_assert(!limited, "ref() after take() is not supported, call it before take()");
+			return parallel_linq<ref_range<TRange>>(ref_range<TRange>(std::move(range)), *pool);
 		}
 
-		auto ref()->linq<ref_range<TRange>>
+		//keeps the first count elements of the ordered result
+		auto take(size_t count) const&->parallel_linq<TRange, true>
 		{
-			return linq<ref_range<TRange>>(range);
+			return parallel_linq(*this).take(count);
 		}
 
-		auto take(int count)->linq<take_range<TRange>>
+		auto take(size_t count) &&->parallel_linq<TRange, true>
 		{
-			auto result = take_range<TRange>(range, count);
-			return linq<take_range<TRange>>(result);
+			return parallel_linq<TRange, true>(std::move(range), *pool, std::min(limit, count));
 		}
 
-		template<typename TOtherRange,typename TKeySelector,typename TOtherKeySelector,typename TCombiner>
-		auto join(
-			const linq<TOtherRange>& other_range,
-			const TKeySelector& key_selector,
-			const TOtherKeySelector& other_key_selector,
-			const TCombiner& combinner)->
-			linq<join_range<
-			TRange,
-			TOtherRange,
-			TKeySelector,
-			TOtherKeySelector,
-			TCombiner >>
+		auto to_vector()->std::vector<value_type>
 		{
-			auto result = join_range<
-				TRange,
-				TOtherRange,
-				TKeySelector,
-				TOtherKeySelector,
-				TCombiner>(range, other_range.range, key_selector, other_key_selector, combinner);
-			return linq<join_range<
-					TRange,
-					TOtherRange,
-					TKeySelector,
-					TOtherKeySelector,
-					TCombiner >>(result);
+			std::vector<std::vector<value_type>> parts(chunk_count());
+			size_t max_count = limit;
+			for_each_chunk(parts.size(), [&](size_t index, slice_type chunk)
+			{
+				std::vector<value_type>& part = parts[index];
+				range_size hint = chunk.size_hint();
+				if (hint.is_exact)
+					part.reserve(std::min(hint.count, max_count));
+				while (part.size() < max_count && chunk.next())
+				{
+					part.push_back(chunk.front());
+				}
+			});
+
+			size_t total = 0;
+			for (size_t i = 0; i < parts.size(); ++i)
+				total += parts[i].size();
+
+			std::vector<value_type> v;
+			v.reserve(std::min(total, limit));
+			for (size_t i = 0; i < parts.size() && v.size() < limit; ++i)
+			{
+				size_t count = std::min(parts[i].size(), limit - v.size());
+				v.insert(v.end(), parts[i].begin(), parts[i].begin() + count);
+			}
+			return v;
 		}
 
-		template<typename TFunction>
-		auto aggregate(typename TRange::value_type init_value, const TFunction& function)
-			->typename TRange::value_type
+		size_t count()
 		{
-			auto range_copy = range;
-			while (range_copy.next())
+			range_size hint = range.size_hint();
+			if (hint.is_exact)
+				return std::min(hint.count, limit);
+
+			std::vector<size_t> parts(chunk_count(), 0);
+			size_t max_count = limit;
+			for_each_chunk(parts.size(), [&](size_t index, slice_type chunk)
 			{
-				init_value = function(init_value, range_copy.front());
-			}
-			return init_value;
+				size_t ret = 0;
+				while (ret < max_count && chunk.next())
+				{
+					++ret;
+				}
+				parts[index] = ret;
+			});
+
+			size_t ret = 0;
+			for (size_t i = 0; i < parts.size(); ++i)
+				ret += parts[i];
+			return std::min(ret, limit);
 		}
 
-		//any
 		template<typename TFunction>
 		bool any(const TFunction& function)
 		{
-			auto range_copy = range;
-			while (range_copy.next())
+			if (limited)
 			{
-				if (function(range_copy.front()))
-					return true;
+				std::vector<value_type> values = to_vector();
+				return std::any_of(values.begin(), values.end(), function);
 			}
-			return false;
+
+			std::atomic<bool> found(false);
+			for_each_chunk(chunk_count(), [&](size_t, slice_type chunk)
+			{
+				while (!found.load(std::memory_order_relaxed) && chunk.next())
+				{
+					if (function(chunk.front()))
+						found = true;
+				}
+			});
+			return found;
 		}
 
 		template<typename TFunction>
 		bool all(const TFunction& function)
 		{
-			auto range_copy = range;
-			while (range_copy.next())
+			if (limited)
 			{
-				if (!function(range_copy.front()))
-					return false;
+				std::vector<value_type> values = to_vector();
+				return std::all_of(values.begin(), values.end(), function);
 			}
-			return true;
-		}
 
-		size_t count()
-		{
-			size_t ret = 0;
-			auto range_copy = range;
-			while (range_copy.next())
+			std::atomic<bool> failed(false);
+			for_each_chunk(chunk_count(), [&](size_t, slice_type chunk)
 			{
-				++ret;
-			}
-			return ret;
+				while (!failed.load(std::memory_order_relaxed) && chunk.next())
+				{
+					if (!function(chunk.front()))
+						failed = true;
+				}
+			});
+			return !failed;
 		}
 
-		template<typename TOtherRange>
-		bool sequence_equal(linq<TOtherRange> other_range)
+		//function must be associative: every chunk is folded on its own, the chunk results are then folded into init_value in order
+		template<typename TFunction>
+		auto aggregate(value_type init_value, const TFunction& function)->value_type
 		{
-			auto range_copy = range;
+			if (limited)
+			{
+				std::vector<value_type> values = to_vector();
+				for (size_t i = 0; i < values.size(); ++i)
+					init_value = function(init_value, values[i]);
+				return init_value;
+			}
 
-			bool range_next = range_copy.next();
-			bool other_range_next = other_range.range.next();
-		
-			while (range_next && other_range_next)
+			std::vector<std::vector<value_type>> parts(chunk_count());
+			for_each_chunk(parts.size(), [&](size_t index, slice_type chunk)
 			{
-				if (range_copy.front() != other_range.range.front())
+				if (!chunk.next())
+					return;
+				value_type value = chunk.front();
+				while (chunk.next())
 				{
-					return false;
+					value = function(value, chunk.front());
 				}
-				range_next = range_copy.next();
-				other_range_next = other_range.range.next(); 
+				parts[index].push_back(value);
+			});
+
+			for (size_t i = 0; i < parts.size(); ++i)
+			{
+				if (!parts[i].empty())
+					init_value = function(init_value, parts[i].front());
 			}
+			return init_value;
+		}
 
-			if (range_next!=other_range_next)
+		//tree reduction: each chunk folds from identity with accumulate, chunk results are then merged
+		//pairwise with combine up a binary tree; combine must be associative and identity neutral for it
+		template<typename TAccumulate, typename TAccumulateFunction, typename TCombineFunction>
+		TAccumulate aggregate(
+			const TAccumulate& identity,
+			const TAccumulateFunction& accumulate,
+			const TCombineFunction& combine)
+		{
+			if (limited)
 			{
-				return false;
+				std::vector<value_type> values = to_vector();
+				TAccumulate ret = identity;
+				for (size_t i = 0; i < values.size(); ++i)
+					ret = accumulate(ret, values[i]);
+				return ret;
 			}
 
-			return true;
+			size_t chunks = chunk_count();
+			if (chunks == 0)
+				return identity;
+
+			std::vector<cache_padded<TAccumulate>, aligned_allocator<cache_padded<TAccumulate>>> partials(chunks, cache_padded<TAccumulate>(identity));
+			reduce_chunks(0, chunks, partials, accumulate, combine);
+			return partials[0].value;
 		}
 
-		auto to_vector()->std::vector<typename TRange::value_type>
+		TRange range;
+
+	private:
+		template<typename TAccumulate, typename TAccumulateFunction, typename TCombineFunction>
+		void reduce_chunks(
+			size_t first,
+			size_t last,
+			std::vector<cache_padded<TAccumulate>, aligned_allocator<cache_padded<TAccumulate>>>& partials,
+			const TAccumulateFunction& accumulate,
+			const TCombineFunction& combine)
 		{
-			std::vector<TRange::value_type> v;
-			auto range_copy = range;
-			while (range_copy.next())
+			if (last - first == 1)
 			{
-				v.push_back(range_copy.front());
+				slice_type chunk = chunk_slice(first, partials.size());
+				TAccumulate& value = partials[first].value;
+				while (chunk.next())
+				{
+					value = accumulate(value, chunk.front());
+				}
+				return;
 			}
-			return v;
+
+			size_t middle = first + (last - first) / 2;
+			pool->fork_join(
+				[&]() {reduce_chunks(first, middle, partials, accumulate, combine); },
+				[&]() {reduce_chunks(middle, last, partials, accumulate, combine); });
+			partials[first].value = combine(partials[first].value, partials[middle].value);
 		}
 
-		TRange range;
-	};
+		size_t chunk_count() const
+		{
+			size_t size = range.split_size();
+			if (size == 0)
+				return 0;
+			return (size + parallel_min_chunk - 1) / parallel_min_chunk;
+		}
+
+		//job(index, slice) for every chunk
+		template<typename TJob>
+		void for_each_chunk(size_t chunks, const TJob& job)
+		{
+			pool->parallel_for(0, chunks, 1, [&](size_t first, size_t last)
+			{
+				for (size_t index = first; index < last; ++index)
+				{
+					job(index, chunk_slice(index, chunks));
+				}
+			});
+		}
 
+		//chunk index out of chunks, each covering an even share of the source positions
+		slice_type chunk_slice(size_t index, size_t chunks) const
+		{
+			size_t size = range.split_size();
+			size_t from = index * (size / chunks) + std::min(index, size % chunks);
+			size_t to = from + size / chunks + (index < size % chunks ? 1 : 0);
+			return range.slice(from, to);
+		}
 
+		thread_pool*	pool;
+		size_t			limit;
+	};
 
 	template<typename TContainer>
 	auto from(const TContainer& container)->linq<basic_range<decltype(std::begin(container))>>
@@ -646,37 +6672,51 @@ namespace TinyLinq
 	//	return linq<storage_range<TContainer>>(range);
 	//}
 
-	template<typename TContainer>
-	auto from_copy(TContainer&& container)->linq<storage_range<TContainer>>
+	//the query owns a copy of the container (or takes it over when moved in), by default uniquely: copies
+	//of the query, like the ones operators and terminals called on a named query work on, borrow it.
+	//pass shared_storage() or local_storage() when copies must outlive the query that owns the container
+	template<typename TContainer, typename TOwnership>
+	auto from_copy(TContainer&& container, TOwnership)->linq<storage_range<typename cleanup_type<TContainer>::type, TOwnership>>
 	{
-		auto range = storage_range<TContainer>(std::forward<TContainer>(container));
-		return linq<storage_range<TContainer>>(range);
+		typedef storage_range<typename cleanup_type<TContainer>::type, TOwnership> range_type;
+		return linq<range_type>(range_type(std::forward<TContainer>(container)));
 	}
 
-	template<typename T,size_t N>
-	auto from_copy(T(&_array)[N])->linq<storage_range<std::vector<T>>>
+	template<typename T, size_t N, typename TOwnership>
+	auto from_copy(T(&_array)[N], TOwnership)->linq<storage_range<std::vector<T>, TOwnership>>
 	{
 		std::vector<T> container(std::begin(_array),std::end(_array));
-		auto range = storage_range<std::vector<T>>(std::move(container));
-		return linq<storage_range<std::vector<T>>>(range);
+		return linq<storage_range<std::vector<T>, TOwnership>>(storage_range<std::vector<T>, TOwnership>(std::move(container)));
 	}
 
+	template<typename TContainer>
+	auto from_copy(TContainer&& container)->linq<storage_range<typename cleanup_type<TContainer>::type, unique_storage>>
+	{
+		return from_copy(std::forward<TContainer>(container), unique_storage());
+	}
 
-	template<typename TValue>
-	auto single(TValue&& value)->linq<storage_range<std::vector<typename cleanup_type<TValue>::type>>>
+	template<typename T, size_t N>
+	auto from_copy(T(&_array)[N])->linq<storage_range<std::vector<T>, unique_storage>>
 	{
-		std::vector<typename cleanup_type<TValue>::type> container;
-		container.push_back(std::forward<TValue>(value));
-		auto range = storage_range<std::vector<typename cleanup_type<TValue>::type>>(std::move(container));
-		return linq<storage_range<std::vector<typename cleanup_type<TValue>::type>>>(range);
+		return from_copy(_array, unique_storage());
 	}
-}
 
 
-//todo
-//order
-//reverse
-//distinct
-//union_with
-//intersect_with
-//except
\ No newline at end of file
+	template<typename TValue>
+	auto single(TValue&& value)->linq<inline_range<typename cleanup_type<TValue>::type, 1>>
+	{
+		typedef typename cleanup_type<TValue>::type value_type;
+		std::array<value_type, 1> values = {{std::forward<TValue>(value)}};
+		return linq<inline_range<value_type, 1>>(inline_range<value_type, 1>(std::move(values)));
+	}
+
+	//the listed values, converted to the type of the first
+	template<typename TValue, typename... TRest>
+	auto just(TValue&& first, TRest&&... rest)->linq<inline_range<typename cleanup_type<TValue>::type, 1 + sizeof...(TRest)>>
+	{
+		typedef typename cleanup_type<TValue>::type value_type;
+		typedef inline_range<value_type, 1 + sizeof...(TRest)> range_type;
+		std::array<value_type, 1 + sizeof...(TRest)> values = {{std::forward<TValue>(first), static_cast<value_type>(std::forward<TRest>(rest))...}};
+		return linq<range_type>(range_type(std::move(values)));
+	}
+}
@@ -1,6 +1,7 @@
 #include "gtest\gtest.h"
 #include "TinyLinq.h"
 #include <numeric>
+#include <list>
 using namespace TinyLinq;
 using namespace std;
 
@@ -196,6 +197,32 @@ TEST(test_select_many,return_ref)
 	EXPECT_TRUE(x.sequence_equal(y));
 }
 
+TEST(test_select_many,empty_inner_and_copies)
+{
+	std::vector<std::vector<int>> lists(5);
+	lists[1].push_back(1);
+	lists[1].push_back(2);
+	lists[3].push_back(3);
+	auto by_ref = [](const std::vector<int>& list)->const std::vector<int>& {return list; };
+	auto by_value = [](const std::vector<int>& list) {return list; };
+
+	std::vector<int> expected;
+	expected.push_back(1);
+	expected.push_back(2);
+	expected.push_back(3);
+	EXPECT_EQ(from(lists).select_many(by_ref).to_vector(), expected);
+	EXPECT_EQ(from(lists).select_many(by_value).to_vector(), expected);
+
+	//a copy taken mid way resumes at the same element
+	auto range = from(lists).select_many(by_value).range;
+	range.next();
+	auto copy = range;
+	EXPECT_TRUE(copy.next());
+	EXPECT_EQ(copy.front(), 2);
+	EXPECT_TRUE(range.next());
+	EXPECT_EQ(range.front(), 2);
+}
+
 TEST(test_ref,all)
 {
 	int test_int_array[] = {1,2,3,4,5,6,7,8,9,10,0};
@@ -216,6 +243,18 @@ TEST(test_ref,all)
 	auto e = c.ref().to_vector();
 	EXPECT_TRUE(c.sequence_equal(d));
 
+	//only sources handing out references to their elements can be wrapped, values computed by
+	//select or join live in a slot the next element overwrites and do not compile
+	typedef decltype(c.where(is_even).take(3).range) filtered_type;
+	typedef decltype(from_copy(std::vector<int>()).concat(just(1)).range) owned_type;
+	typedef decltype(c.select(double_it).range) selected_type;
+	typedef decltype(c.select(double_it).where(is_even).range) filtered_selected_type;
+	typedef decltype(c.join(c, double_it, double_it, add).range) joined_type;
+	EXPECT_TRUE(has_element_references<filtered_type>::value);
+	EXPECT_TRUE(has_element_references<owned_type>::value);
+	EXPECT_FALSE(has_element_references<selected_type>::value);
+	EXPECT_FALSE(has_element_references<filtered_selected_type>::value);
+	EXPECT_FALSE(has_element_references<joined_type>::value);
 }
 
 
@@ -254,6 +293,23 @@ TEST(test_concat, all)
 	EXPECT_TRUE(c.sequence_equal(e));
 }
 
+TEST(test_concat, inline_values)
+{
+	auto values = just(4, 5, 6).concat(single(7)).concat(8);
+	std::vector<int> expected;
+	for (int i = 4; i <= 8; ++i)
+		expected.push_back(i);
+	EXPECT_EQ(values.to_vector(), expected);
+	EXPECT_TRUE(values.range.size_hint().is_exact);
+	EXPECT_EQ(values.count(), 5);
+
+	EXPECT_EQ(just(1.5, 2, 3.5f).sum(), 7.0);
+	EXPECT_EQ(just(3, 1, 2).max(), 3);
+	EXPECT_EQ(just(3, 1, 2).skip(1).element_at(1), 2);
+	EXPECT_EQ(just(std::string("a"), "b").last(), "b");
+	EXPECT_EQ(just(1, 2, 3).where(greater_than(1)).to_vector().size(), 2);
+}
+
 TEST(test_take,all)
 {
 	int count = 3;
@@ -321,4 +377,1143 @@ TEST(join, all)
 	EXPECT_EQ(a.count(), b.count());
 	printf("%d", b.count());
 
-}
\ No newline at end of file
+}
+TEST(size_hint, propagation)
+{
+	std::vector<int> a(std::begin(test_int_array), std::end(test_int_array));
+	size_t n = a.size();
+
+	auto exact = from(a).select(double_it).ref().range.size_hint();
+	EXPECT_TRUE(exact.is_exact);
+	EXPECT_EQ(exact.count, n);
+
+	auto taken = from(test_int_array).take(3).range.size_hint();
+	EXPECT_TRUE(taken.is_exact);
+	EXPECT_EQ(taken.count, 3);
+
+	auto filtered = from(a).where(is_even).take(100).range.size_hint();
+	EXPECT_FALSE(filtered.is_exact);
+	EXPECT_EQ(filtered.count, n);
+
+	auto concated = from(a).concat(from_copy(std::vector<int>(a))).range.size_hint();
+	EXPECT_TRUE(concated.is_exact);
+	EXPECT_EQ(concated.count, 2 * n);
+
+	auto flattened = from(person_array).select_many([](const Person& p)->const string& {return p.name; }).range.size_hint();
+	EXPECT_FALSE(flattened.is_known());
+
+	auto v = from(a).select(double_it).to_vector();
+	EXPECT_EQ(v.capacity(), n);
+	EXPECT_EQ(from(a).where(is_even).count(), 6);
+	EXPECT_FALSE(from(a).sequence_equal(from(a).take(3)));
+}
+
+TEST(random_access, element_at_skip_last)
+{
+	std::vector<int> a(std::begin(test_int_array), std::end(test_int_array));
+	auto x = from(a).select(double_it);
+
+	EXPECT_EQ(x.element_at(4), 8);
+	EXPECT_EQ(x.last(), 20);
+	EXPECT_EQ(x.skip(3).take(4).to_vector(), from(a).where([](int v) {return v >= 3 && v < 7; }).select(double_it).to_vector());
+	EXPECT_EQ(x.skip(8).count(), 3);
+	EXPECT_EQ(x.skip(100).count(), 0);
+	EXPECT_EQ(from(a).skip(2).take(5).element_at(4), 6);
+	EXPECT_THROW(x.element_at(11), std::out_of_range);
+	EXPECT_THROW(x.skip(11).last(), std::out_of_range);
+
+	auto y = from(a).where(is_even);
+	EXPECT_EQ(y.element_at(2), 4);
+	EXPECT_EQ(y.last(), 10);
+	EXPECT_EQ(y.skip(4).to_vector(), from(a).where([](int v) {return v >= 8 && v % 2 == 0; }).to_vector());
+	EXPECT_THROW(y.element_at(6), std::out_of_range);
+	EXPECT_TRUE(x.sequence_equal(from(a).select(double_it)));
+}
+
+TEST(join, matches_nested_loop)
+{
+	std::vector<int> keys;
+	for (int i = 0; i < 1000; ++i)
+		keys.push_back(i * 7 % 130);
+
+	auto a = from(keys)
+		.join(
+			from(keys).select([](int v) {return v * 3; }),
+			[](int v) {return v; },
+			[](int v) {return v / 3; },
+			[](int l, int r) {return std::make_pair(l, r); })
+		.to_vector();
+
+	std::vector<std::pair<int, int>> b;
+	FOR_EACH(l, keys)
+	{
+		FOR_EACH(r, keys)
+		{
+			if (*l == *r)
+				b.push_back(std::make_pair(*l, *r * 3));
+		}
+	}
+	EXPECT_EQ(a, b);
+
+	flat_hash_multimap<int, int> map;
+	map.insert(1, 10);
+	map.insert(2, 20);
+	map.insert(1, 11);
+	map.seal();
+	auto found = map.equal_range(1);
+	ASSERT_EQ(found.second - found.first, 2);
+	EXPECT_EQ(found.first[0], 10);
+	EXPECT_EQ(found.first[1], 11);
+	EXPECT_EQ(map.max_equal_count(), 2);
+	EXPECT_TRUE(map.equal_range(3).first == map.equal_range(3).second);
+}
+
+TEST(join, build_side_shared_by_copies)
+{
+	//the build side is drained and keyed once, whichever copy of the query gets there first
+	int build_count = 0;
+	int build_key_count = 0;
+	auto a = from(person_array)
+		.join(
+			from(phone_number_array).where([&](const PhoneNumber&) {++build_count; return true; }),
+			[](const Person& p) {return p.id; },
+			[&](const PhoneNumber& phone) {++build_key_count; return phone.id; },
+			[](const Person&, const PhoneNumber& phone) {return phone.num; });
+	EXPECT_EQ(build_key_count, 0);
+
+	auto b = a;
+	EXPECT_EQ(a.count(), 5);
+	EXPECT_EQ(b.to_vector(), a.to_vector());
+	EXPECT_TRUE(a.sequence_equal(b));
+	EXPECT_EQ(build_count, sizeof(phone_number_array) / sizeof(PhoneNumber));
+	EXPECT_EQ(build_key_count, sizeof(phone_number_array) / sizeof(PhoneNumber));
+}
+
+TEST(join, partitioned_mode)
+{
+	std::vector<int> keys;
+	for (int i = 0; i < 5000; ++i)
+		keys.push_back(i * 7919 % 1237);
+
+	auto make_join = [&](join_mode mode)
+	{
+		return from(keys)
+			.join(
+				from(keys).take(2000),
+				[](int v) {return v; },
+				[](int v) {return v; },
+				[](int l, int r) {return l * 10000 + r; },
+				mode);
+	};
+
+	auto hashed = make_join(join_mode::hash).to_vector();
+	auto partitioned = make_join(join_mode::partitioned);
+	EXPECT_EQ(partitioned.to_vector(), hashed);
+	EXPECT_EQ(partitioned.count(), hashed.size());
+	EXPECT_EQ(make_join(join_mode::automatic).to_vector(), hashed);
+}
+
+TEST(as_parallel, matches_sequential)
+{
+	std::vector<int> a;
+	for (int i = 0; i < 100000; ++i)
+		a.push_back(i * 31 % 1001);
+
+	auto sequential = from(a).where(is_even).select(double_it);
+	auto parallel = from(a).as_parallel().where(is_even).select(double_it);
+
+	EXPECT_EQ(parallel.to_vector(), sequential.to_vector());
+	EXPECT_EQ(parallel.count(), sequential.count());
+	EXPECT_EQ(parallel.take(10).to_vector(), sequential.take(10).to_vector());
+	EXPECT_EQ(parallel.take(10).count(), 10);
+	EXPECT_EQ(parallel.aggregate(0, add), sequential.aggregate(0, add));
+	EXPECT_TRUE(parallel.any([](int v) {return v == 2000; }));
+	EXPECT_FALSE(parallel.any(is_odd));
+	EXPECT_TRUE(parallel.all(is_even));
+	EXPECT_FALSE(parallel.take(5).any([](int v) {return v == 2000; }));
+
+	auto joined = from(a)
+		.join(from(test_int_array), [](int v) {return v; }, [](int v) {return v; }, add)
+		.as_parallel();
+	EXPECT_EQ(joined.to_vector(), from(a).join(from(test_int_array), [](int v) {return v; }, [](int v) {return v; }, add).to_vector());
+	EXPECT_EQ(from_copy(std::vector<int>(a)).as_parallel().select(double_it).to_vector(), from(a).select(double_it).to_vector());
+}
+
+TEST(thread_pool, fork_join_and_parallel_for)
+{
+	thread_pool pool(4);
+	std::vector<int> hits(10000, 0);
+	pool.parallel_for(0, hits.size(), 7, [&](size_t from, size_t to)
+	{
+		for (size_t i = from; i < to; ++i)
+			++hits[i];
+	});
+	EXPECT_TRUE(from(hits).all([](int v) {return v == 1; }));
+
+	int left = 0;
+	int right = 0;
+	pool.fork_join([&]() {left = 1; }, [&]() {right = 2; });
+	EXPECT_EQ(left + right, 3);
+
+	EXPECT_THROW(pool.parallel_for(0, 100, 1, [](size_t from, size_t) {if (from == 42) throw std::runtime_error("boom"); }), std::runtime_error);
+
+	std::vector<int> a;
+	for (int i = 0; i < 50000; ++i)
+		a.push_back(i);
+	auto skewed = [](int v)
+	{
+		int spin = v < 1000 ? 2000 : 1;
+		int acc = 0;
+		for (int i = 0; i < spin; ++i)
+			acc += i % 3;
+		return (v + acc) % 3 == 0;
+	};
+	EXPECT_EQ(from(a).as_parallel(pool).where(skewed).to_vector(), from(a).where(skewed).to_vector());
+
+	thread_pool::set_default_pool(&pool);
+	EXPECT_EQ(from(a).as_parallel().count(), a.size());
+	thread_pool::set_default_pool(NULL);
+}
+
+TEST(as_parallel, tree_aggregate)
+{
+	thread_pool pool(4);
+	std::vector<int> a;
+	for (int i = 0; i < 200000; ++i)
+		a.push_back(i % 1000);
+
+	auto add_to = [](long long acc, int v) {return acc + v; };
+	auto merge = [](long long l, long long r) {return l + r; };
+	long long expected = std::accumulate(a.begin(), a.end(), 0LL);
+	EXPECT_EQ(from(a).as_parallel(pool).aggregate(0LL, add_to, merge), expected);
+	EXPECT_EQ(from(a).aggregate(0LL, add_to, merge), expected);
+
+	//order sensitive but associative: concatenation keeps the sequential order
+	auto digits = from(a).take(3000).select([](int v) {return v % 10; });
+	auto append = [](std::string acc, int v) {return acc + char('0' + v); };
+	auto concat_strings = [](const std::string& l, const std::string& r) {return l + r; };
+	EXPECT_EQ(digits.as_parallel(pool).aggregate(std::string(), append, concat_strings), digits.aggregate(std::string(), append, concat_strings));
+	auto none = from(a).as_parallel(pool).where([](int v) {return v > 2000; });
+	EXPECT_EQ(none.aggregate(0LL, add_to, merge), 0);
+
+	//each partial sits on a cache line of its own
+	EXPECT_EQ(sizeof(cache_padded<char>), cache_line_size);
+	EXPECT_EQ(sizeof(cache_padded<std::string>) % cache_line_size, 0);
+	std::vector<cache_padded<long long>, aligned_allocator<cache_padded<long long>>> partials(5, cache_padded<long long>(0));
+	for (size_t i = 0; i < partials.size(); ++i)
+		EXPECT_EQ(reinterpret_cast<size_t>(&partials[i]) % cache_line_size, 0);
+}
+
+TEST(simd, kernels_match_scalar)
+{
+	std::vector<int> ints;
+	std::vector<float> floats;
+	std::vector<double> doubles;
+	for (int i = 0; i < 1003; ++i)
+	{
+		ints.push_back((i * 7919) % 1000 - 500);
+		floats.push_back(static_cast<float>((i * 31) % 64) - 32.0f);
+		doubles.push_back(((i * 13) % 100) * 0.5 - 10);
+	}
+	auto below = [](int v) {return v < 100; };
+	auto non_negative = [](float v) {return v >= 0; };
+	auto is_four_and_half = [](double v) {return v == 4.5; };
+	auto above_five = [](int v) {return v > 5; };
+	auto twice = [](int v) {return v * 2; };
+
+	simd_level detected = detect_simd_level();
+	simd_level levels[] = {simd_level::scalar, simd_level::sse2, simd_level::avx2, simd_level::avx512};
+	for (simd_level level : levels)
+	{
+		set_simd_level(level);
+		EXPECT_EQ(from(ints).sum(), std::accumulate(ints.begin(), ints.end(), 0));
+		EXPECT_EQ(from(ints).min(), *std::min_element(ints.begin(), ints.end()));
+		EXPECT_EQ(from(ints).max(), *std::max_element(ints.begin(), ints.end()));
+		EXPECT_EQ(from(floats).sum(), std::accumulate(floats.begin(), floats.end(), 0.0f));
+		EXPECT_EQ(from(doubles).min(), *std::min_element(doubles.begin(), doubles.end()));
+		EXPECT_EQ(from(doubles).max(), *std::max_element(doubles.begin(), doubles.end()));
+
+		EXPECT_EQ(from(ints).where(less_than(100)).count(), from(ints).where(below).count());
+		EXPECT_EQ(from(ints).where(less_than(100)).to_vector(), from(ints).where(below).to_vector());
+		EXPECT_EQ(from(ints).where(not_equals(0)).count(), ints.size() - 1);
+		EXPECT_EQ(from(floats).where(greater_or_equal(0.0f)).count(), from(floats).where(non_negative).count());
+		EXPECT_EQ(from(doubles).where(equals(4.5)).to_vector(), from(doubles).where(is_four_and_half).to_vector());
+		EXPECT_EQ(from(test_int_array).where(greater_than(5)).to_vector(), from(test_int_array).where(above_five).to_vector());
+		EXPECT_EQ(from(test_int_array).where(less_or_equal(3)).count(), 4);
+	}
+	set_simd_level(detected);
+
+	std::vector<int> empty;
+	EXPECT_EQ(from(empty).sum(), 0);
+	EXPECT_EQ(from(empty).where(less_than(1)).count(), 0);
+	EXPECT_THROW(from(empty).min(), std::out_of_range);
+	EXPECT_THROW(from(empty).max(), std::out_of_range);
+	EXPECT_EQ(from(test_int_array).select(twice).sum(), 110);
+	EXPECT_EQ(from(test_int_array).where(less_than(5)).max(), 4);
+}
+
+TEST(simd, mixed_type_constant)
+{
+	std::vector<double> doubles;
+	doubles.push_back(4.5);
+	doubles.push_back(3);
+	doubles.push_back(5.5);
+	auto above_four = [](double v) {return v > 4; };
+	auto below_four_and_half = [](int v) {return v < 4.5; };
+
+	EXPECT_EQ(from(doubles).where(greater_than(4)).count(), 2);
+	EXPECT_EQ(from(doubles).where(greater_than(4)).to_vector(), from(doubles).where(above_four).to_vector());
+	EXPECT_EQ(from(doubles).where(not_equals(4)).count(), 3);
+	EXPECT_EQ(from(test_int_array).where(less_than(4.5)).to_vector(), from(test_int_array).where(below_four_and_half).to_vector());
+	EXPECT_EQ(from(test_int_array).where(less_or_equal(4.5)).count(), 5);
+}
+
+TEST(batch, matches_element_pull)
+{
+	std::vector<int> a;
+	for (int i = 0; i < 1000; ++i)
+		a.push_back(i);
+	auto odd = [](int v) {return v % 2 == 1; };
+	auto square = [](int v) {return v * v; };
+	auto sum_up = [](int acc, int v) {return acc + v; };
+
+	auto query = from(a).skip(3).where(odd).select(square).concat(from(test_int_array)).take(700);
+	std::vector<int> expected;
+	auto pulled = query.range;
+	while (pulled.next())
+		expected.push_back(pulled.front());
+	EXPECT_EQ(query.to_vector(), expected);
+	EXPECT_EQ(query.count(), expected.size());
+	EXPECT_EQ(query.aggregate(0, sum_up), std::accumulate(expected.begin(), expected.end(), 0));
+
+	//next() resumes after the last element of a batch, a batch resumes after front()
+	auto mixed = query.range;
+	std::vector<int> got;
+	int buffer[7];
+	for (bool by_batch = false;; by_batch = !by_batch)
+	{
+		if (by_batch)
+		{
+			const int* values = NULL;
+			size_t n = pull_batch(mixed, values, buffer, 7);
+			if (n == 0)
+				break;
+			got.insert(got.end(), values, values + n);
+		}
+		else
+		{
+			if (!mixed.next())
+				break;
+			got.push_back(mixed.front());
+		}
+	}
+	EXPECT_EQ(got, expected);
+
+	//ranges without next_batch go through the element fallback
+	typedef ref_range<basic_range<std::vector<int>::iterator>> ref_type;
+	EXPECT_FALSE(has_next_batch<ref_type>::value);
+	EXPECT_EQ(from(a).ref().count(), a.size());
+	EXPECT_EQ(from(a).where(odd).reverse().take(3).to_vector(), std::vector<int>({999, 997, 995}));
+}
+
+//pulls range element by element, then in batches of 7 taken between calls of next(): both see the same elements
+template<typename TRange, typename TProjection>
+void expect_batches_match(const TRange& range, const TProjection& project)
+{
+	typedef typename TRange::value_type value_type;
+	typedef typename std::decay<decltype(project(std::declval<const value_type&>()))>::type projected_type;
+
+	std::vector<projected_type> expected;
+	TRange pulled = range;
+	while (pulled.next())
+		expected.push_back(project(pulled.front()));
+
+	std::vector<projected_type> got;
+	TRange mixed = range;
+	std::vector<value_type> buffer(7);
+	for (bool by_batch = false;; by_batch = !by_batch)
+	{
+		if (by_batch)
+		{
+			const value_type* values = NULL;
+			size_t n = mixed.next_batch(values, &buffer[0], buffer.size());
+			if (n == 0)
+				break;
+			for (size_t i = 0; i < n; ++i)
+				got.push_back(project(values[i]));
+		}
+		else
+		{
+			if (!mixed.next())
+				break;
+			got.push_back(project(mixed.front()));
+		}
+	}
+	EXPECT_EQ(got, expected);
+	EXPECT_FALSE(expected.empty());
+}
+
+TEST(batch, every_stage_matches_element_pull)
+{
+	std::vector<int> a;
+	for (int i = 0; i < 1000; ++i)
+		a.push_back(i * 7919 % 1237);
+	std::vector<std::string> words;
+	for (int v : a)
+		words.push_back(std::to_string(v % 100));
+
+	auto same = [](int v) {return v; };
+	auto same_word = [](const std::string& s) -> const std::string& {return s; };
+	auto nested = [](int v) {return std::vector<int>(v % 3, v); };
+	auto digits = [](int v) {return std::to_string(v); };
+	auto tenth = [](int v) {return v / 10; };
+	auto third = [](int v) {return v / 3; };
+	auto odd = [](int v) {return v % 2 == 1; };
+	auto add = [](int acc, int v) {return acc + v; };
+	auto pair_up = [](int l, int r) {return std::make_pair(l, r); };
+	auto same_pair = [](const std::pair<int, int>& p) {return p; };
+	auto group_summary = [](const grouping<int, int>& g) {return std::make_pair(g.key, std::accumulate(g.elements.begin(), g.elements.end(), 0)); };
+
+	expect_batches_match(from(a).select_many(nested).range, same);
+	expect_batches_match(from(a).select_many(digits).range, same);
+	expect_batches_match(from(a).distinct_by(tenth).range, same);
+	expect_batches_match(from(words).distinct_by(same_word).range, same_word);
+	expect_batches_match(from(a).intersect_with(from(a).take(300)).range, same);
+	expect_batches_match(from(a).take(300).except(from(a).skip(200)).range, same);
+	expect_batches_match(from(a).except(from(a).take(300)).range, same);
+	expect_batches_match(from(a).select(third).distinct_until_changed().range, same);
+	expect_batches_match(from(a).order_by(tenth).then_by_descending(same).range, same);
+	expect_batches_match(from(a).where(odd).reverse().range, same);
+	expect_batches_match(from(a).group_by(tenth).range, group_summary);
+	expect_batches_match(from(a).aggregate_by(tenth, 0, add).range, same_pair);
+	expect_batches_match(from(a).group_adjacent(third).range, group_summary);
+	expect_batches_match(from(a).aggregate_adjacent(third, 0, add).range, same_pair);
+	expect_batches_match(from(a).join(from(a).take(300), same, same, pair_up, join_mode::hash).range, same_pair);
+	expect_batches_match(from(a).join(from(a).take(300), same, same, pair_up, join_mode::partitioned).range, same_pair);
+}
+
+TEST(select, front_evaluated_once)
+{
+	std::vector<int> a;
+	for (int i = 0; i < 100; ++i)
+		a.push_back(i);
+
+	int calls = 0;
+	auto format = [&calls](int v) {++calls; return std::to_string(v); };
+	auto short_text = [](const std::string& s) {return s.size() == 1; };
+	auto query = from(a).select(format).where(short_text);
+	auto range = query.range;
+	std::vector<std::string> texts;
+	while (range.next())
+	{
+		texts.push_back(range.front());
+		EXPECT_EQ(range.front(), texts.back());
+	}
+	EXPECT_EQ(texts.size(), 10);
+	EXPECT_EQ(calls, 100);
+
+	int combined = 0;
+	auto key = [](int v) {return v % 10; };
+	auto combine = [&combined](int l, int r) {++combined; return l * 1000 + r; };
+	auto joined = from(a).take(20).join(from(a).take(10), key, key, combine).where([](int v) {return v % 2 == 0; });
+	auto joined_range = joined.range;
+	size_t matches = 0;
+	while (joined_range.next())
+	{
+		EXPECT_EQ(joined_range.front() % 2, 0);
+		++matches;
+	}
+	EXPECT_EQ(combined, 20);
+	EXPECT_EQ(matches, 10);
+	EXPECT_EQ(from(a).select(format).element_at(42), "42");
+}
+
+TEST(iterator, std_algorithms_and_range_for)
+{
+	std::vector<int> a;
+	for (int i = 0; i < 100; ++i)
+		a.push_back(i);
+	auto even = [](int v) {return v % 2 == 0; };
+	auto half = [](int v) {return v / 2; };
+
+	std::vector<int> visited;
+	for (int v : from(a).where(even).select(half))
+		visited.push_back(v);
+	EXPECT_EQ(visited, from(a).where(even).select(half).to_vector());
+
+	auto evens = from(a).where(even);
+	EXPECT_EQ(std::accumulate(evens.begin(), evens.end(), 0), 2450);
+	std::vector<int> copied;
+	std::copy(evens.begin(), evens.end(), std::back_inserter(copied));
+	EXPECT_EQ(copied.size(), 50);
+	EXPECT_TRUE((std::is_same<decltype(evens)::iterator::iterator_category, std::input_iterator_tag>::value));
+
+	auto tail = from(a).skip(10).take(80);
+	EXPECT_TRUE((std::is_same<decltype(tail)::iterator::iterator_category, std::random_access_iterator_tag>::value));
+	EXPECT_EQ(tail.end() - tail.begin(), 80);
+	EXPECT_EQ(tail.begin()[3], 13);
+	auto found = std::lower_bound(tail.begin(), tail.end(), 40);
+	EXPECT_EQ(found - tail.begin(), 30);
+	EXPECT_EQ(*found, 40);
+	EXPECT_TRUE(std::equal(tail.begin(), tail.end(), tail.to_vector().begin()));
+
+	//select computes each element into one slot, so its pipelines only stream
+	auto halves = from(a).skip(10).select(half);
+	EXPECT_TRUE((std::is_same<decltype(halves)::iterator::iterator_category, std::input_iterator_tag>::value));
+	EXPECT_TRUE((std::is_same<decltype(halves.take(5))::iterator::iterator_category, std::input_iterator_tag>::value));
+	EXPECT_TRUE(std::equal(halves.begin(), halves.end(), halves.to_vector().begin()));
+	auto at = tail.begin();
+	EXPECT_EQ(std::max(at[0], at[3]), 13);
+	std::vector<int> backwards(std::reverse_iterator<decltype(at)>(tail.end()), std::reverse_iterator<decltype(at)>(at));
+	EXPECT_EQ(backwards.front(), 89);
+	EXPECT_EQ(backwards.size(), 80);
+
+	std::vector<int> empty;
+	EXPECT_TRUE(from(empty).where(even).begin() == from(empty).where(even).end());
+	EXPECT_TRUE(from(empty).begin() == from(empty).end());
+}
+
+TEST(from_copy, ownership)
+{
+	std::vector<std::string> words;
+	words.push_back("a");
+	words.push_back("bb");
+	words.push_back("ccc");
+
+	auto unique = from_copy(words, unique_storage());
+	auto local = from_copy(words, local_storage());
+	auto shared = from_copy(words, shared_storage());
+	typedef decltype(from_copy(words)) default_query;
+	EXPECT_TRUE((std::is_same<default_query, decltype(unique)>::value));
+	EXPECT_EQ(unique.to_vector(), words);
+	EXPECT_EQ(local.to_vector(), words);
+	EXPECT_EQ(shared.to_vector(), words);
+	EXPECT_EQ(from_copy(test_int_array, local_storage()).count(), 11);
+
+	//a copy of a unique range borrows the container and resumes at the same position
+	auto range = unique.range;
+	range.next();
+	range.next();
+	auto copy = range;
+	EXPECT_TRUE(unique.range.owns_container());
+	EXPECT_FALSE(copy.owns_container());
+	EXPECT_EQ(&copy.front(), &range.front());
+	EXPECT_EQ(copy.front(), "bb");
+	EXPECT_TRUE(copy.next());
+	EXPECT_EQ(copy.front(), "ccc");
+	EXPECT_FALSE(copy.next());
+
+	//shared and local copies point at the same elements
+	auto local_range = local.range;
+	local_range.next();
+	auto local_copy = local_range;
+	EXPECT_EQ(&local_copy.front(), &local_range.front());
+	auto moved = std::move(local_copy);
+	EXPECT_EQ(moved.front(), "a");
+}
+
+struct copy_counting_predicate
+{
+	copy_counting_predicate(int* _copies)
+		:copies(_copies)
+	{}
+
+	copy_counting_predicate(const copy_counting_predicate& other)
+		:copies(other.copies)
+	{
+		++*copies;
+	}
+
+	copy_counting_predicate(copy_counting_predicate&& other)
+		:copies(other.copies)
+	{}
+
+	bool operator()(int v) const
+	{
+		return v % 2 == 0;
+	}
+
+	int* copies;
+};
+
+TEST(linq, rvalue_pipeline_moves_stages)
+{
+	int copies = 0;
+	auto query = from(test_int_array).where(copy_counting_predicate(&copies)).select(double_it).take(3);
+	EXPECT_EQ(copies, 0);
+
+	//terminals on an lvalue run on a copy, on a temporary they consume it
+	EXPECT_EQ(query.to_vector(), std::vector<int>({0, 4, 8}));
+	EXPECT_EQ(copies, 1);
+
+	//building on top of an lvalue copies it once
+	auto more = query.skip(1);
+	EXPECT_EQ(copies, 2);
+	EXPECT_EQ(std::move(more).sum(), 12);
+	EXPECT_EQ(std::move(query).count(), 3);
+	EXPECT_EQ(copies, 2);
+
+	//a uniquely owned container is moved along the chain, never deep copied
+	std::vector<int> big(1000, 1);
+	const int* data = big.data();
+	auto positive = [](int v){return v > 0;};
+	auto owned = from_copy(std::move(big), unique_storage());
+	EXPECT_EQ(owned.range.data(), data);
+	EXPECT_EQ(&std::move(owned).where(positive).ref().element_at(0).get(), data);
+
+	//as_parallel() operators follow the same rule
+	copies = 0;
+	auto parallel = from(test_int_array).as_parallel().where(copy_counting_predicate(&copies)).select(double_it);
+	EXPECT_EQ(copies, 0);
+	auto first_three = parallel.take(3);
+	EXPECT_EQ(copies, 1);
+	auto moved_three = std::move(parallel).take(3);
+	EXPECT_EQ(copies, 1);
+	EXPECT_EQ(moved_three.to_vector(), std::vector<int>({0, 4, 8}));
+	EXPECT_EQ(first_three.to_vector(), std::vector<int>({0, 4, 8}));
+}
+
+struct copy_counted
+{
+	copy_counted(int _value = 0)
+		:value(_value)
+	{}
+
+	copy_counted(const copy_counted& other)
+		:value(other.value)
+	{
+		++copies;
+	}
+
+	copy_counted(copy_counted&& other) noexcept
+		:value(other.value)
+	{}
+
+	copy_counted& operator=(const copy_counted& other)
+	{
+		value = other.value;
+		++copies;
+		return *this;
+	}
+
+	copy_counted& operator=(copy_counted&& other) noexcept
+	{
+		value = other.value;
+		return *this;
+	}
+
+	int value;
+	static int copies;
+};
+
+int copy_counted::copies = 0;
+
+TEST(to_vector, moves_owned_elements)
+{
+	std::vector<copy_counted> items;
+	for (int i = 0; i < 1000; ++i)
+		items.push_back(copy_counted(i));
+
+	//borrowed elements are copied
+	copy_counted::copies = 0;
+	EXPECT_EQ(from(items).to_vector().size(), 1000);
+	EXPECT_EQ(copy_counted::copies, 1000);
+
+	//values computed by select are moved
+	copy_counted::copies = 0;
+	auto next = [](const copy_counted& c){return copy_counted(c.value + 1);};
+	auto selected = from(items).select(next).to_vector();
+	EXPECT_EQ(copy_counted::copies, 0);
+	EXPECT_EQ(selected.back().value, 1000);
+
+	//so are elements of a container the query owns alone
+	copy_counted::copies = 0;
+	auto moved = from_copy(std::move(items), unique_storage()).concat(just(copy_counted(-1))).to_vector();
+	EXPECT_EQ(copy_counted::copies, 0);
+	EXPECT_EQ(moved.size(), 1001);
+	EXPECT_EQ(moved[999].value, 999);
+	EXPECT_EQ(moved.back().value, -1);
+
+	//but not when it is shared with other copies of the query
+	auto shared = from_copy(moved, shared_storage());
+	copy_counted::copies = 0;
+	EXPECT_EQ(shared.to_vector().size(), 1001);
+	EXPECT_EQ(copy_counted::copies, 1001);
+	EXPECT_EQ(shared.last().value, -1);
+
+	//a query reused by name lends its container to the copies terminals and operators run on,
+	//which copy the elements out rather than move them
+	auto reused = from_copy(moved);
+	auto non_negative = [](const copy_counted& c){return c.value >= 0;};
+	copy_counted::copies = 0;
+	EXPECT_EQ(reused.count(), 1001);
+	EXPECT_EQ(reused.skip(1000).count(), 1);
+	EXPECT_EQ(reused.last().value, -1);
+	EXPECT_EQ(copy_counted::copies, 1);
+	EXPECT_EQ(reused.where(non_negative).to_vector().size(), 1000);
+	EXPECT_EQ(copy_counted::copies, 1001);
+	auto borrowed = reused;
+	EXPECT_EQ(std::move(borrowed).to_vector().back().value, -1);
+	EXPECT_EQ(copy_counted::copies, 2002);
+
+	//only the query owning the container moves its elements out
+	EXPECT_EQ(std::move(reused).to_vector().size(), 1001);
+	EXPECT_EQ(copy_counted::copies, 2002);
+}
+
+TEST(sinks, read_elements_in_place)
+{
+	std::vector<copy_counted> items;
+	for (int i = 0; i < 1000; ++i)
+		items.push_back(copy_counted(i));
+	auto even = [](const copy_counted& c){return c.value % 2 == 0;};
+	auto value = [](const copy_counted& c){return c.value;};
+	auto tenth = [](const copy_counted& c){return c.value / 10;};
+	auto add_value = [](int acc, const copy_counted& c){return acc + c.value;};
+
+	copy_counted::copies = 0;
+	EXPECT_EQ(from(items).where(even).count(), 500);
+	EXPECT_EQ(from(items).where(even).to_unordered_map(value, tenth).size(), 500);
+	EXPECT_EQ(from(items).where(even).to_map(value, tenth).size(), 500);
+	EXPECT_EQ(from(items).where(even).to_lookup(tenth, value).size(), 500);
+	EXPECT_EQ(from(items).where(even).aggregate_by(tenth, 0, add_value).count(), 100);
+	EXPECT_EQ(copy_counted::copies, 0);
+
+	//groups keep a copy of each element, and nothing more: batches move the groups out
+	EXPECT_EQ(from(items).where(even).group_by(tenth).count(), 100);
+	EXPECT_EQ(copy_counted::copies, 500);
+	copy_counted::copies = 0;
+	EXPECT_EQ(from(items).where(even).group_by(tenth).to_vector().size(), 100);
+	EXPECT_EQ(copy_counted::copies, 500);
+}
+
+TEST(iterator, copies_share_the_query)
+{
+	std::vector<copy_counted> items;
+	for (int i = 0; i < 1000; ++i)
+		items.push_back(copy_counted(i));
+	auto by_value = [](const copy_counted& l, const copy_counted& r){return l.value < r.value;};
+	auto odd = [](const copy_counted& c){return c.value % 2 == 1;};
+
+	auto sorted = from_copy(items);
+	auto first = sorted.begin();
+	auto last = sorted.end();
+	copy_counted::copies = 0;
+	auto found = std::lower_bound(first, last, copy_counted(600), by_value);
+	EXPECT_EQ(copy_counted::copies, 0);
+	EXPECT_EQ(found - first, 600);
+	EXPECT_EQ(found->value, 600);
+	auto moved = first;
+	moved += 10;
+	++moved;
+	EXPECT_EQ(first->value, 0);
+	EXPECT_EQ(moved->value, 11);
+	EXPECT_EQ(first[11].value, 11);
+
+	auto odds = from_copy(items).where(odd);
+	auto iter = odds.begin();
+	copy_counted::copies = 0;
+	auto copy = iter;
+	EXPECT_EQ(copy_counted::copies, 0);
+	EXPECT_EQ((*copy).value, 1);
+	EXPECT_EQ((*iter++).value, 1);
+	EXPECT_EQ((*copy).value, 3);
+	EXPECT_EQ(std::distance(iter, odds.end()), 499);
+}
+
+TEST(sinks, keyed_and_set)
+{
+	auto id = [](const Person& p){return p.id;};
+	auto name = [](const Person& p){return p.name;};
+	auto by_id = from(person_array).to_unordered_map(id, name);
+	EXPECT_EQ(by_id.size(), 3);
+	EXPECT_EQ(by_id[2], "ivan");
+
+	auto by_name = from(person_array).to_map(name, id);
+	EXPECT_EQ(by_name.begin()->first, "fabio");
+	EXPECT_EQ(by_name["kidding"], 3);
+
+	//the first element of a key wins
+	auto phone_id = [](const PhoneNumber& p){return p.id;};
+	auto phone_num = [](const PhoneNumber& p){return p.num;};
+	auto first_phone = from(phone_number_array).to_unordered_map(phone_id, phone_num);
+	EXPECT_EQ(first_phone.size(), 4);
+	EXPECT_EQ(first_phone[3], 700);
+
+	auto phones = from(phone_number_array).to_lookup(phone_id, phone_num);
+	auto range = phones.equal_range(4);
+	EXPECT_EQ(range.second - range.first, 2);
+	EXPECT_EQ(range.first[0], 800);
+	EXPECT_EQ(range.first[1], 801);
+	EXPECT_TRUE(phones.equal_range(5).first == phones.equal_range(5).second);
+
+	std::vector<int> repeated(test_int_array, test_int_array + 11);
+	repeated.insert(repeated.end(), test_int_array, test_int_array + 11);
+	auto odd = from(repeated).where(is_odd);
+	EXPECT_EQ(odd.to_set(), std::set<int>({1, 3, 5, 7, 9}));
+	EXPECT_EQ(odd.to_unordered_set().size(), 5);
+	EXPECT_EQ(odd.to_deque().size(), 10);
+	EXPECT_EQ(from(repeated).to_deque().back(), 10);
+
+	std::vector<std::string> words;
+	words.push_back("b");
+	words.push_back("a");
+	words.push_back("b");
+	auto word_set = from_copy(std::move(words)).to_set();
+	EXPECT_EQ(word_set.size(), 2);
+	EXPECT_EQ(*word_set.begin(), "a");
+	EXPECT_EQ(from(person_array).select(name).to_unordered_set().count("ivan"), 1);
+}
+
+TEST(order_by, keys_and_stability)
+{
+	int values[] = {5, 3, 9, 1, 7, 3};
+	auto identity = [](int v){return v;};
+	EXPECT_EQ(from(values).order_by(identity).to_vector(), std::vector<int>({1, 3, 3, 5, 7, 9}));
+	EXPECT_EQ(from(values).order_by_descending(identity).to_vector(), std::vector<int>({9, 7, 5, 3, 3, 1}));
+	EXPECT_EQ(from(values).where(is_odd).order_by(identity).take(2).to_vector(), std::vector<int>({1, 3}));
+
+	//keys are computed once per element, and only once the query runs
+	int key_calls = 0;
+	auto counted_key = [&](int v){++key_calls; return -v;};
+	auto sorted = from(values).order_by(counted_key);
+	EXPECT_EQ(key_calls, 0);
+	EXPECT_EQ(sorted.to_vector(), std::vector<int>({9, 7, 5, 3, 3, 1}));
+	EXPECT_EQ(key_calls, 6);
+
+	//ties keep the source order, then_by breaks them
+	auto id = [](const PhoneNumber& p){return p.id;};
+	auto num = [](const PhoneNumber& p){return p.num;};
+	auto by_id = from(phone_number_array).order_by_descending(id).select(num).to_vector();
+	EXPECT_EQ(by_id, std::vector<int>({800, 801, 700, 701, 600, 500, 501}));
+	auto then_desc = from(phone_number_array).order_by_descending(id).then_by_descending(num).select(num).to_vector();
+	EXPECT_EQ(then_desc, std::vector<int>({801, 800, 701, 700, 600, 501, 500}));
+	auto even_id = [](const PhoneNumber& p){return p.id % 2;};
+	auto then_asc = from(phone_number_array).order_by(even_id).then_by_descending(id).then_by(num).select(num).to_vector();
+	EXPECT_EQ(then_asc, std::vector<int>({800, 801, 600, 700, 701, 500, 501}));
+
+	auto name = [](const Person& p){return p.name;};
+	auto people = from_copy(std::vector<Person>(person_array, person_array + 3)).order_by_descending(name);
+	EXPECT_EQ(people.count(), 3);
+	EXPECT_EQ(people.to_vector()[0], kidding);
+	std::vector<int> empty;
+	EXPECT_EQ(from(empty).order_by(identity).count(), 0);
+}
+
+TEST(order_by, partial_pulls)
+{
+	std::vector<int> values;
+	for (int i = 0; i < 5000; ++i)
+		values.push_back((i * 7919) % 5003);
+	std::vector<int> expected = values;
+	std::sort(expected.begin(), expected.end());
+
+	auto identity = [](int v){return v;};
+	auto sorted = from(values).order_by(identity);
+	EXPECT_EQ(sorted.first(), expected[0]);
+	EXPECT_EQ(sorted.take(50).to_vector(), std::vector<int>(expected.begin(), expected.begin() + 50));
+	EXPECT_EQ(sorted.to_vector(), expected);
+	EXPECT_EQ(from(values).order_by_descending(identity).first(), expected.back());
+	EXPECT_TRUE(sorted.any([](int v){return v > 5000;}));
+
+	//many equal keys, already sorted and reversed input
+	std::vector<int> runs;
+	for (int i = 0; i < 3000; ++i)
+		runs.push_back(i / 1000);
+	auto coarse = [](int v){return v / 2;};
+	EXPECT_EQ(from(runs).order_by_descending(coarse).take(3).to_vector(), std::vector<int>({2, 2, 2}));
+	EXPECT_EQ(from(runs).order_by(identity).to_vector(), runs);
+	std::vector<int> reversed(runs.rbegin(), runs.rend());
+	EXPECT_EQ(from(reversed).order_by(identity).to_vector(), runs);
+
+	std::vector<int> empty;
+	EXPECT_THROW(from(empty).order_by(identity).first(), std::out_of_range);
+	EXPECT_EQ(from(test_int_array).first(), 0);
+}
+
+TEST(distinct, first_occurrences)
+{
+	int values[] = {3, 1, 3, 2, 1, 5, 2, 3};
+	EXPECT_EQ(from(values).distinct().to_vector(), std::vector<int>({3, 1, 2, 5}));
+	EXPECT_EQ(from(values).distinct().take(2).to_vector(), std::vector<int>({3, 1}));
+	EXPECT_EQ(from(values).select(double_it).distinct().count(), 4);
+
+	auto id = [](const PhoneNumber& p){return p.id;};
+	auto num = [](const PhoneNumber& p){return p.num;};
+	EXPECT_EQ(from(phone_number_array).distinct_by(id).select(num).to_vector(), std::vector<int>({500, 600, 700, 800}));
+
+	//keys referring into a stable source are remembered by address, copies keep their own set
+	std::vector<std::string> words;
+	words.push_back("b");
+	words.push_back("a");
+	words.push_back("b");
+	words.push_back("c");
+	words.push_back("a");
+	auto unique_words = from(words).distinct();
+	typedef decltype(unique_words.range) unique_words_range;
+	EXPECT_TRUE((std::is_same<unique_words_range::seen_type, seen_keys<std::string, true>>::value));
+	auto range = unique_words.range;
+	range.next();
+	auto copy = range;
+	EXPECT_TRUE(copy.next());
+	EXPECT_EQ(copy.front(), "a");
+	EXPECT_TRUE(copy.next());
+	EXPECT_EQ(copy.front(), "c");
+	EXPECT_FALSE(copy.next());
+	EXPECT_EQ(from_copy(words).distinct().to_vector(), std::vector<std::string>({"b", "a", "c"}));
+	auto first_letter = [](const std::string& s){return s[0];};
+	auto exclaim = [](const std::string& s){return s + "!";};
+	EXPECT_EQ(from(words).select(exclaim).distinct_by(first_letter).count(), 3);
+
+	std::vector<int> many;
+	for (int i = 0; i < 10000; ++i)
+		many.push_back(i % 997);
+	EXPECT_EQ(from(many).distinct().count(), 997);
+	EXPECT_EQ(from(many).distinct().last(), 996);
+}
+
+struct tagged
+{
+	explicit tagged(const std::string& _tag)
+		:tag(_tag)
+	{}
+
+	bool operator==(const tagged& rhs) const
+	{
+		return tag == rhs.tag;
+	}
+
+	std::string tag;
+};
+
+namespace std
+{
+	template<>
+	struct hash<tagged>
+	{
+		size_t operator()(const tagged& value) const
+		{
+			return std::hash<std::string>()(value.tag);
+		}
+	};
+}
+
+TEST(set_operations, unbatchable_elements)
+{
+	//no default constructor: results are pulled one element at a time, and moving one empties its tag
+	std::vector<tagged> first;
+	first.push_back(tagged("x"));
+	first.push_back(tagged("x"));
+	first.push_back(tagged("y"));
+	first.push_back(tagged("x"));
+	std::vector<tagged> second;
+	second.push_back(tagged("z"));
+
+	auto kept = from(first).except(from(second)).to_vector();
+	EXPECT_EQ(kept.size(), 2);
+	EXPECT_EQ(kept[1].tag, "y");
+	second.push_back(tagged("x"));
+	EXPECT_EQ(from(first).intersect_with(from(second)).to_vector().size(), 1);
+}
+
+TEST(set_operations, union_intersect_except)
+{
+	int first[] = {5, 3, 9, 3, 1, 7};
+	int second[] = {7, 2, 3, 8, 2};
+	EXPECT_EQ(from(first).union_with(from(second)).to_vector(), std::vector<int>({5, 3, 9, 1, 7, 2, 8}));
+	EXPECT_EQ(from(first).intersect_with(from(second)).to_vector(), std::vector<int>({3, 7}));
+	EXPECT_EQ(from(first).except(from(second)).to_vector(), std::vector<int>({5, 9, 1}));
+
+	//a much larger second sequence: the first one is hashed instead, the order stays the first's
+	std::vector<int> big;
+	for (int i = 0; i < 1000; ++i)
+		big.push_back(999 - i);
+	EXPECT_EQ(from(first).intersect_with(from(big)).to_vector(), std::vector<int>({5, 3, 9, 1, 7}));
+	EXPECT_EQ(from(first).concat(just(-1, 5)).intersect_with(from(big)).count(), 5);
+	EXPECT_EQ(from(first).concat(just(-1, 5)).except(from(big)).to_vector(), std::vector<int>({-1}));
+	EXPECT_EQ(from(big).except(from(first)).count(), 995);
+	EXPECT_EQ(from(big).where(is_even).intersect_with(from(first)).count(), 0);
+
+	//unknown sizes, lazily: nothing is read before the first element is pulled
+	int reads = 0;
+	auto counted = [&](int v){++reads; return v;};
+	auto odd_big = from(big).select(counted).where(is_odd).except(from(first));
+	EXPECT_EQ(reads, 0);
+	EXPECT_EQ(odd_big.take(2).to_vector(), std::vector<int>({999, 997}));
+
+	std::vector<std::string> left;
+	left.push_back("a");
+	left.push_back("b");
+	std::vector<std::string> right;
+	right.push_back("b");
+	right.push_back("c");
+	EXPECT_EQ(from(left).union_with(from(right)).count(), 3);
+	EXPECT_EQ(from_copy(left).intersect_with(from(right)).to_vector(), std::vector<std::string>({"b"}));
+	EXPECT_EQ(from(left).except(from_copy(std::move(right))).to_vector(), std::vector<std::string>({"a"}));
+}
+
+TEST(reverse, in_place_and_buffered)
+{
+	EXPECT_EQ(from(test_int_array).reverse().take(3).to_vector(), std::vector<int>({10, 9, 8}));
+	EXPECT_EQ(from(test_int_array).select(double_it).reverse().first(), 20);
+	EXPECT_EQ(from(test_int_array).reverse().count(), 11);
+	EXPECT_EQ(just(1, 2, 3).reverse().to_vector(), std::vector<int>({3, 2, 1}));
+	EXPECT_EQ(from(test_int_array).where(is_even).reverse().to_vector(), std::vector<int>({10, 8, 6, 4, 2, 0}));
+
+	//arrays, vectors and lists walk backwards without a buffer, references point into the source
+	typedef decltype(from(test_int_array).ref().range) ref_type;
+	typedef decltype(from(test_int_array).where(is_even).range) where_type;
+	typedef decltype(from(test_int_array).ref().reverse().range) in_place_type;
+	typedef decltype(from(test_int_array).where(is_even).reverse().range) buffered_type;
+	EXPECT_TRUE((std::is_same<in_place_type, reverse_range<ref_type>>::value));
+	EXPECT_TRUE((std::is_same<buffered_type, buffered_reverse_range<where_type>>::value));
+	EXPECT_EQ(&from(test_int_array).ref().reverse().first().get(), &test_int_array[10]);
+
+	std::list<std::string> log;
+	log.push_back("start");
+	log.push_back("work");
+	log.push_back("stop");
+	EXPECT_EQ(from(log).reverse().to_vector(), std::vector<std::string>({"stop", "work", "start"}));
+
+	//an owned container keeps its reversed position in copies
+	auto owned = from_copy(std::vector<int>(test_int_array, test_int_array + 11)).reverse();
+	auto range = owned.range;
+	range.next();
+	range.next();
+	auto copy = range;
+	EXPECT_EQ(copy.front(), 9);
+	EXPECT_TRUE(copy.next());
+	EXPECT_EQ(copy.front(), 8);
+
+	std::vector<int> empty;
+	EXPECT_EQ(from(empty).reverse().count(), 0);
+	EXPECT_FALSE(from(empty).where(is_even).reverse().any(is_even));
+}
+
+TEST(group_by, groups_and_aggregates)
+{
+	auto id = [](const PhoneNumber& p){return p.id;};
+	auto groups = from(phone_number_array).group_by(id).to_vector();
+	EXPECT_EQ(groups.size(), 4);
+	EXPECT_EQ(groups[0].key, 1);
+	EXPECT_EQ(groups[0].elements.size(), 2);
+	EXPECT_EQ(groups[3].key, 4);
+	EXPECT_EQ(groups[3].elements[1].num, 801);
+
+	auto parity = [](int v){return v % 2 == 0 ? std::string("even") : std::string("odd");};
+	auto by_parity = from(test_int_array).group_by(parity);
+	EXPECT_EQ(by_parity.count(), 2);
+	EXPECT_EQ(by_parity.first().key, "even");
+	EXPECT_EQ(from(by_parity.first().elements).sum(), 30);
+
+	//only one accumulator per key is kept
+	auto count_phones = [](int count, const PhoneNumber&){return count + 1;};
+	auto counts = from(phone_number_array).aggregate_by(id, 0, count_phones).to_vector();
+	EXPECT_EQ(counts.size(), 4);
+	EXPECT_EQ(counts[1], std::make_pair(2, 1));
+	EXPECT_EQ(counts[3], std::make_pair(4, 2));
+
+	std::vector<int> many;
+	for (int i = 0; i < 100000; ++i)
+		many.push_back(i);
+	auto bucket = [](int v){return v % 1000;};
+	auto sums = from(many).aggregate_by(bucket, 0LL, [](long long acc, int v){return acc + v;}).to_unordered_map(
+		[](const std::pair<int, long long>& p){return p.first;},
+		[](const std::pair<int, long long>& p){return p.second;});
+	EXPECT_EQ(sums.size(), 1000);
+	EXPECT_EQ(sums[7], 100 * 7 + 1000LL * (99 * 100 / 2));
+
+	std::vector<int> empty;
+	EXPECT_EQ(from(empty).group_by(bucket).count(), 0);
+	EXPECT_FALSE(from(empty).aggregate_by(bucket, 0, add).any([](const std::pair<int, int>&){return true;}));
+}
+
+TEST(group_adjacent, runs_of_equal_keys)
+{
+	auto id = [](const PhoneNumber& p){return p.id;};
+	auto runs = from(phone_number_array).group_adjacent(id).to_vector();
+	EXPECT_EQ(runs.size(), 4);
+	EXPECT_EQ(runs[0].key, 1);
+	EXPECT_EQ(runs[0].elements.size(), 2);
+	EXPECT_EQ(runs[1].elements.size(), 1);
+	EXPECT_EQ(runs[3].elements[1].num, 801);
+
+	//unsorted input: a key comes back once per run, the key selector runs once per element
+	int values[] = {1, 1, 2, 1, 3, 3, 3};
+	int key_calls = 0;
+	auto counted = [&](int v){++key_calls; return v;};
+	auto groups = from(values).group_adjacent(counted);
+	std::vector<int> keys;
+	std::vector<size_t> sizes;
+	for (auto& group : groups)
+	{
+		keys.push_back(group.key);
+		sizes.push_back(group.elements.size());
+	}
+	EXPECT_EQ(keys, std::vector<int>({1, 2, 1, 3}));
+	EXPECT_EQ(sizes, std::vector<size_t>({2, 1, 1, 3}));
+	EXPECT_EQ(key_calls, 7);
+
+	auto count_phones = [](int count, const PhoneNumber&){return count + 1;};
+	auto counts = from(phone_number_array).aggregate_adjacent(id, 0, count_phones).to_vector();
+	EXPECT_EQ(counts.size(), 4);
+	EXPECT_EQ(counts[0], std::make_pair(1, 2));
+	EXPECT_EQ(counts[2], std::make_pair(3, 2));
+	auto second = [](const std::pair<int, int>& p){return p.second;};
+	EXPECT_EQ(from(values).aggregate_adjacent(counted, 0, add).select(second).to_vector(), std::vector<int>({2, 2, 1, 9}));
+
+	EXPECT_EQ(from(values).distinct_until_changed().to_vector(), std::vector<int>({1, 2, 1, 3}));
+	std::vector<std::string> words;
+	words.push_back("a");
+	words.push_back("a");
+	words.push_back("b");
+	words.push_back("b");
+	words.push_back("a");
+	EXPECT_EQ(from_copy(std::move(words)).distinct_until_changed().count(), 3);
+
+	std::vector<int> empty;
+	EXPECT_EQ(from(empty).group_adjacent(counted).count(), 0);
+	EXPECT_EQ(from(empty).aggregate_adjacent(counted, 0, add).count(), 0);
+	EXPECT_EQ(from(empty).distinct_until_changed().count(), 0);
+
+	//a copy taken mid-way carries the current group and the previous element along
+	auto partial = from(values).group_adjacent(counted);
+	EXPECT_TRUE(partial.range.next());
+	auto resumed = partial.range;
+	EXPECT_EQ(resumed.front().elements.size(), 2);
+	EXPECT_TRUE(resumed.next());
+	EXPECT_EQ(resumed.front().key, 2);
+	auto changes = from(values).distinct_until_changed();
+	EXPECT_TRUE(changes.range.next());
+	auto changes_copy = changes.range;
+	EXPECT_TRUE(changes_copy.next());
+	EXPECT_EQ(changes_copy.front(), 2);
+}
+
+TEST(group_adjacent, unknown_source_size)
+{
+	std::list<int> values;
+	values.push_back(1);
+	values.push_back(1);
+	values.push_back(2);
+	values.push_back(3);
+	auto identity = [](int v){return v;};
+
+	auto groups = from(values).group_adjacent(identity);
+	EXPECT_TRUE(groups.range.next());
+	EXPECT_FALSE(groups.range.size_hint().is_known());
+	EXPECT_EQ(groups.count(), 2);
+	EXPECT_EQ(groups.to_vector().back().key, 3);
+
+	auto sums = from(values).aggregate_adjacent(identity, 0, add);
+	EXPECT_TRUE(sums.range.next());
+	EXPECT_FALSE(sums.range.size_hint().is_known());
+	EXPECT_EQ(sums.count(), 2);
+	EXPECT_EQ(sums.to_vector().front(), std::make_pair(2, 2));
+
+	//over a vector the hint still counts the element the next run starts with
+	std::vector<int> copied(values.begin(), values.end());
+	auto bounded = from(copied).group_adjacent(identity);
+	EXPECT_TRUE(bounded.range.next());
+	EXPECT_EQ(bounded.range.size_hint().count, 2);
+}